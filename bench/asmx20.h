@@ -0,0 +1,153 @@
+#ifndef ASMX20_H
+#define ASMX20_H
+
+// Tiny VMX20 encoder used by the benchmarks to generate their programs.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// opcodes
+enum {
+    HALT, LOAD, STORE, LDIMM, LDADDR, LDIND, STIND, ADDF, SUBF, DIVF, MULF,
+    ADDI, SUBI, DIVI, MULI, CALL, RET, BLT, BGT, BEQ, JMP, CMPXCHG, GETPID,
+    GETPN, PUSH, POP
+};
+
+typedef struct {
+    char name[16];
+    int32_t addr;
+} AsmSym;
+
+typedef struct {
+    int32_t* code;
+    int size;
+    int cap;
+    AsmSym* insyms;
+    int num_insyms;
+    AsmSym* outsyms;
+    int num_outsyms;
+} Asm;
+
+static inline void asm_init(Asm* a)
+{
+    memset(a, 0, sizeof(Asm));
+}
+
+static inline void asm_free(Asm* a)
+{
+    free(a->code);
+    free(a->insyms);
+    free(a->outsyms);
+}
+
+// address of the next word to be emitted
+static inline int asm_here(Asm* a)
+{
+    return a->size;
+}
+
+static inline int asm_word(Asm* a, int32_t word)
+{
+    if (a->size == a->cap)
+    {
+        a->cap = a->cap ? a->cap * 2 : 256;
+        a->code = (int32_t*) realloc(a->code, sizeof(int32_t) * a->cap);
+        if (!a->code)
+        {
+            printf("ERROR: Could not grow code buffer\n");
+            exit(1);
+        }
+    }
+    a->code[a->size] = word;
+    return a->size++;
+}
+
+// op reg, imm20 (ldimm, getpid, getpn, push, pop)
+static inline int asm_ri(Asm* a, int op, int r, int32_t imm)
+{
+    return asm_word(a, op | (r << 8) | ((imm & 0xfffff) << 12));
+}
+
+// op reg, reg (arithmetic)
+static inline int asm_rr(Asm* a, int op, int r1, int r2)
+{
+    return asm_word(a, op | (r1 << 8) | (r2 << 12));
+}
+
+// op reg, off(reg) (ldind, stind)
+static inline int asm_rro(Asm* a, int op, int r1, int r2, int32_t off)
+{
+    return asm_word(a, op | (r1 << 8) | (r2 << 12) | ((off & 0xffff) << 16));
+}
+
+// op reg, target (load, store, ldaddr) and op target (call, jmp), pc-relative
+static inline int asm_rt(Asm* a, int op, int r, int target)
+{
+    return asm_ri(a, op, r, target - (a->size + 1));
+}
+
+// op reg, reg, target (blt, bgt, beq, cmpxchg), pc-relative
+static inline int asm_rrt(Asm* a, int op, int r1, int r2, int target)
+{
+    return asm_rro(a, op, r1, r2, target - (a->size + 1));
+}
+
+// point a previously emitted pc-relative instruction at target
+static inline void asm_patch(Asm* a, int at, int target)
+{
+    int32_t word = a->code[at];
+    int op = word & 0xff;
+    int32_t off = target - (at + 1);
+    if (op == BLT || op == BGT || op == BEQ || op == CMPXCHG)
+        a->code[at] = (word & 0xffff) | ((off & 0xffff) << 16);
+    else
+        a->code[at] = (word & 0xfff) | ((off & 0xfffff) << 12);
+}
+
+static inline void asm_sym(AsmSym** syms, int* num, const char* name, int addr)
+{
+    *syms = (AsmSym*) realloc(*syms, sizeof(AsmSym) * (*num + 1));
+    memset(&(*syms)[*num], 0, sizeof(AsmSym));
+    snprintf((*syms)[*num].name, sizeof((*syms)[*num].name), "%s", name);
+    (*syms)[*num].addr = addr;
+    (*num)++;
+}
+
+// define name at addr
+static inline void asm_insym(Asm* a, const char* name, int addr)
+{
+    asm_sym(&a->insyms, &a->num_insyms, name, addr);
+}
+
+// reference name from the instruction at addr, to be resolved by linkx20
+static inline void asm_outsym(Asm* a, const char* name, int addr)
+{
+    asm_sym(&a->outsyms, &a->num_outsyms, name, addr);
+}
+
+// write an object (.obj) or executable (.exe, no outsymbols) file
+static inline void asm_write(Asm* a, const char* path)
+{
+    FILE* file = fopen(path, "w");
+    if (!file)
+    {
+        printf("ERROR: Could not make output file %s\n", path);
+        exit(1);
+    }
+
+    int32_t hdr[3] = { a->num_insyms * 5, a->num_outsyms * 5, a->size };
+    if (fwrite(hdr, sizeof(int32_t), 3, file) != 3 ||
+        fwrite(a->insyms, sizeof(AsmSym), a->num_insyms, file) != a->num_insyms ||
+        fwrite(a->outsyms, sizeof(AsmSym), a->num_outsyms, file) != a->num_outsyms ||
+        fwrite(a->code, sizeof(int32_t), a->size, file) != a->size)
+    {
+        printf("ERROR: Could not write %s\n", path);
+        exit(1);
+    }
+
+    fclose(file);
+}
+
+#endif
@@ -0,0 +1,144 @@
+// Version 2 executable check.
+//
+// Links one program with linkx20 as a version 1 and as a version 2
+// executable. The program counts the nonzero words just past the end of its
+// code, where a version 2 file keeps its symbol index and trailer. They must
+// read as zero in both formats, in a fresh VM and in a pooled VM that was
+// reset between runs. Exits with 1 on a mismatch.
+//
+// Usage: ./exe2
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#define LINKER "../linker/linkx20"
+
+// words read past the end of the code
+#define PAST_WORDS 256
+
+// address of the result word
+static int results;
+
+// count the nonzero words among the PAST_WORDS after the code
+static void build_past(const char* path)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    int end = asm_rt(&a, LDADDR, 2, 0);
+    asm_ri(&a, LDIMM, 3, 0);
+    asm_ri(&a, LDIMM, 4, 1);
+    asm_ri(&a, LDIMM, 5, PAST_WORDS);
+    asm_ri(&a, LDIMM, 7, 0);
+    int loop = asm_here(&a);
+    asm_rro(&a, LDIND, 6, 2, 0);
+    int zero = asm_rrt(&a, BEQ, 6, 7, 0);
+    asm_rr(&a, ADDI, 1, 4);
+    asm_patch(&a, zero, asm_here(&a));
+    asm_rr(&a, ADDI, 2, 4);
+    asm_rr(&a, ADDI, 3, 4);
+    asm_rrt(&a, BLT, 3, 5, loop);
+    int store = asm_rt(&a, STORE, 1, 0);
+    asm_word(&a, HALT);
+    results = asm_word(&a, -1);
+    asm_patch(&a, store, results);
+    asm_patch(&a, end, asm_here(&a));
+    asm_insym(&a, "mainx20", 0);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+// link obj into out.exe, passing flag to linkx20 unless it is NULL
+static void link_obj(const char* obj, const char* flag, const char* out)
+{
+    char* argv[6];
+    int argc = 0;
+    argv[argc++] = LINKER;
+    if (flag)
+        argv[argc++] = (char*) flag;
+    argv[argc++] = (char*) obj;
+    argv[argc++] = "-o";
+    argv[argc++] = (char*) out;
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execv(LINKER, argv);
+        printf("ERROR: Could not run %s\n", LINKER);
+        _exit(1);
+    }
+    int wstatus = 0;
+    if (pid < 0 || waitpid(pid, &wstatus, 0) != pid || !WIFEXITED(wstatus) ||
+            WEXITSTATUS(wstatus) != 0)
+    {
+        printf("ERROR: Linking %s failed\n", obj);
+        exit(1);
+    }
+}
+
+// run vm once, returning the nonzero words it saw, or -1 if it didn't halt
+static int32_t run(void* vm)
+{
+    uint32_t sp = VMX20_DEFAULT_MEMORY_WORDS - 16;
+    int status = 0;
+    int32_t nonzero = -1;
+    if (!execute(vm, 1, &sp, &status, 0) || status != VMX20_NORMAL_TERMINATION)
+        return -1;
+    getWord(vm, results, &nonzero);
+    return nonzero;
+}
+
+static int report(const char* check, const char* exe, int32_t nonzero)
+{
+    printf("%s %s %d %d\n", check, exe, nonzero, nonzero == 0);
+    return nonzero != 0;
+}
+
+int main(int argc, char* argv[])
+{
+    build_past("exe2_past.obj");
+    link_obj("exe2_past.obj", NULL, "exe2_v1");
+    link_obj("exe2_past.obj", "-2", "exe2_v2");
+    const char* exes[] = { "exe2_v1.exe", "exe2_v2.exe" };
+
+    printf("check exe nonzero match\n");
+    int mismatches = 0;
+    for (int e = 0; e < 2; e++)
+    {
+        char path[64];
+        strcpy(path, exes[e]);
+        int32_t err = 0;
+
+        void* vm = initVm(&err);
+        if (!vm || !loadExecutableFile(vm, path, &err))
+        {
+            printf("ERROR: Could not load %s (%d)\n", path, err);
+            exit(1);
+        }
+        mismatches += report("fresh", exes[e], run(vm));
+        cleanup(vm);
+
+        // the second acquire resets the VM that ran the first time
+        void* pool = createVmPool(1, VMX20_DEFAULT_MEMORY_WORDS, 0, &err);
+        for (int i = 0; i < 2; i++)
+        {
+            vm = pool ? acquireVm(pool, path, &err) : NULL;
+            if (!vm)
+            {
+                printf("ERROR: Could not acquire %s (%d)\n", path, err);
+                exit(1);
+            }
+            mismatches += report(i ? "reset" : "pooled", exes[e], run(vm));
+            releaseVm(pool, vm);
+        }
+        destroyVmPool(pool);
+    }
+
+    return mismatches != 0;
+}
@@ -0,0 +1,278 @@
+// JIT benchmark and differential check.
+//
+// Runs a set of kernels once through the interpreter and once with
+// VMX20_EXEC_JIT, and compares the termination status and the result
+// words each kernel leaves behind. The kernels cover the hot loops the JIT
+// compiles natively as well as its side exits: traps, stores into the
+// code region and code that rewrites itself. Exits with 1 on a mismatch.
+//
+// Usage: ./jit [scale]
+
+#define _GNU_SOURCE
+#include <time.h>
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#define RESULTS 4
+
+// addresses of the result words of the kernel being built
+static int results;
+
+// r = count, built with a multiply since ldimm only reaches 2^19; uses r13
+static void load_count(Asm* a, int r, int count)
+{
+    asm_ri(a, LDIMM, r, count / 1000 > 0 ? count / 1000 : 1);
+    asm_ri(a, LDIMM, 13, count / 1000 > 0 ? 1000 : count);
+    asm_rr(a, MULI, r, 13);
+}
+
+// reserve the result words and point the stores at them
+static void finish(Asm* a, int* stores, int num_stores, const char* path)
+{
+    asm_word(a, HALT);
+    results = asm_here(a);
+    for (int i = 0; i < RESULTS; i++)
+        asm_word(a, 0);
+    for (int i = 0; i < num_stores; i++)
+        asm_patch(a, stores[i], results + i);
+    asm_insym(a, "mainx20", 0);
+    asm_write(a, path);
+    asm_free(a);
+}
+
+// sum of i*i for i below n
+static void build_int(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 4, 0);
+    int loop = asm_here(&a);
+    asm_ri(&a, LDIMM, 5, 0);
+    asm_rr(&a, ADDI, 5, 1);
+    asm_rr(&a, MULI, 5, 5);
+    asm_rr(&a, ADDI, 4, 5);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    int stores[2];
+    stores[0] = asm_rt(&a, STORE, 4, 0);
+    stores[1] = asm_rt(&a, STORE, 1, 0);
+    finish(&a, stores, 2, path);
+}
+
+// x = (x * 0.999 + 0.001) / 1.0, n times
+static void build_float(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    int consts[4];
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n);
+    asm_ri(&a, LDIMM, 3, 1);
+    consts[0] = asm_rt(&a, LOAD, 4, 0);
+    consts[1] = asm_rt(&a, LOAD, 5, 0);
+    consts[2] = asm_rt(&a, LOAD, 6, 0);
+    consts[3] = asm_rt(&a, LOAD, 7, 0);
+    int loop = asm_here(&a);
+    asm_rr(&a, MULF, 4, 5);
+    asm_rr(&a, ADDF, 4, 6);
+    asm_rr(&a, DIVF, 4, 7);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 4, 0);
+    int skip = asm_rt(&a, JMP, 0, 0);
+
+    float values[4] = { 1.0f, 0.999f, 0.001f, 1.0f };
+    int words[4];
+    for (int i = 0; i < 4; i++)
+    {
+        int32_t bits;
+        memcpy(&bits, &values[i], 4);
+        words[i] = asm_word(&a, bits);
+    }
+    for (int i = 0; i < 4; i++)
+        asm_patch(&a, consts[i], words[i]);
+    asm_patch(&a, skip, asm_here(&a));
+    finish(&a, stores, 1, path);
+}
+
+// fill an array past the code, then sum it, repeated n / 4096 times
+static void build_array(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 7, 200000);
+    asm_ri(&a, LDIMM, 2, 4096);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 4, 0);
+    asm_ri(&a, LDIMM, 10, 0);
+    asm_ri(&a, LDIMM, 11, n / 4096 > 0 ? n / 4096 : 1);
+    int outer = asm_here(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    int fill = asm_here(&a);
+    asm_ri(&a, LDIMM, 8, 0);
+    asm_rr(&a, ADDI, 8, 7);
+    asm_rr(&a, ADDI, 8, 1);
+    asm_rro(&a, STIND, 1, 8, 0);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, fill);
+    asm_ri(&a, LDIMM, 1, 0);
+    int sum = asm_here(&a);
+    asm_ri(&a, LDIMM, 8, 0);
+    asm_rr(&a, ADDI, 8, 7);
+    asm_rr(&a, ADDI, 8, 1);
+    asm_rro(&a, LDIND, 9, 8, 0);
+    asm_rr(&a, ADDI, 4, 9);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, sum);
+    asm_rr(&a, ADDI, 10, 3);
+    asm_rrt(&a, BLT, 10, 11, outer);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 4, 0);
+    finish(&a, stores, 1, path);
+}
+
+// divide by a counter that reaches zero, storing the running sum into the
+// code region on every iteration
+static void build_divtrap(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 10);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 4, 100000);
+    asm_ri(&a, LDIMM, 6, 0);
+    int loop = asm_here(&a);
+    asm_ri(&a, LDIMM, 5, 0);
+    asm_rr(&a, ADDI, 5, 4);
+    asm_rr(&a, DIVI, 5, 1);
+    asm_rr(&a, ADDI, 6, 5);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 6, 0);
+    asm_rr(&a, SUBI, 1, 3);
+    asm_rt(&a, JMP, 0, loop);
+    finish(&a, stores, 1, path);
+}
+
+// a loop that bumps the constant of its own ldimm on every iteration
+static void build_selfmod(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n / 100);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 4, 0);
+    asm_ri(&a, LDIMM, 9, 1 << 12);
+    int loop = asm_here(&a);
+    int imm = asm_ri(&a, LDIMM, 5, 0);
+    asm_rr(&a, ADDI, 4, 5);
+    asm_rt(&a, LOAD, 8, imm);
+    asm_rr(&a, ADDI, 8, 9);
+    asm_rt(&a, STORE, 8, imm);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 4, 0);
+    finish(&a, stores, 1, path);
+}
+
+// an indexed load that walks off the end of memory
+static void build_range(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 7, 10000);
+    asm_ri(&a, LDIMM, 8, 1000);
+    asm_rr(&a, MULI, 7, 8);
+    asm_ri(&a, LDIMM, 8, 0);
+    asm_rr(&a, ADDI, 8, 7);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 10, 20);
+    asm_rr(&a, SUBI, 8, 10);
+    asm_ri(&a, LDIMM, 4, 0);
+    int loop = asm_here(&a);
+    asm_rro(&a, LDIND, 9, 8, 0);
+    asm_rr(&a, ADDI, 4, 3);
+    asm_rr(&a, ADDI, 8, 3);
+    asm_rt(&a, JMP, 0, loop);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 4, 0);
+    finish(&a, stores, 1, path);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// run path once with flags, returning the status and the result words
+static double run(const char* exe, int32_t flags, int* status, int32_t* out)
+{
+    int32_t err = 0;
+    char path[64];
+    strcpy(path, exe);
+    void* vm = initVm(&err);
+    if (!vm || !loadExecutableFile(vm, path, &err))
+    {
+        printf("ERROR: Could not load %s (%d)\n", exe, err);
+        exit(1);
+    }
+
+    uint32_t sp = VMX20_DEFAULT_MEMORY_WORDS - 16;
+    double start = now();
+    execute(vm, 1, &sp, status, flags);
+    double secs = now() - start;
+
+    for (int i = 0; i < RESULTS; i++)
+        getWord(vm, results + i, &out[i]);
+    cleanup(vm);
+    return secs;
+}
+
+int main(int argc, char* argv[])
+{
+    int scale = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    struct {
+        const char* name;
+        void (*build)(const char*, int);
+    } kernels[] = {
+        { "int", build_int },
+        { "float", build_float },
+        { "array", build_array },
+        { "divtrap", build_divtrap },
+        { "selfmod", build_selfmod },
+        { "range", build_range },
+    };
+    int num_kernels = sizeof(kernels) / sizeof(kernels[0]);
+
+    printf("kernel status interp_seconds jit_seconds speedup match\n");
+    int mismatches = 0;
+    for (int k = 0; k < num_kernels; k++)
+    {
+        char path[64];
+        sprintf(path, "jit_%s.exe", kernels[k].name);
+        kernels[k].build(path, scale);
+
+        int status[2];
+        int32_t out[2][RESULTS];
+        double interp = run(path, 0, &status[0], out[0]);
+        double jit = run(path, VMX20_EXEC_JIT, &status[1], out[1]);
+
+        int match = status[0] == status[1] && memcmp(out[0], out[1], sizeof(out[0])) == 0;
+        if (!match)
+            mismatches++;
+        printf("%s %d %.4f %.4f %.2f %d\n", kernels[k].name, status[0], interp, jit,
+            jit > 0 ? interp / jit : 0, match);
+    }
+
+    return mismatches != 0;
+}
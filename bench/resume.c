@@ -0,0 +1,193 @@
+// Instruction budget and resume check.
+//
+// Runs programs under setInstructionBudget and resumes them until they
+// finish, comparing the termination status and the result words against
+// an unbudgeted run. Also checks that resume leaves processors that halted
+// halted, and that resumePastHalt carries them on from a snapshot. Exits
+// with 1 on a mismatch.
+//
+// Usage: ./resume [budget]
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#define RESULTS 2
+#define PROCS 2
+
+// address of the result words of the program being built
+static int results;
+
+// reserve the result words and point the stores at them
+static void finish(Asm* a, int* stores, int num_stores, const char* path)
+{
+    results = asm_here(a);
+    for (int i = 0; i < RESULTS; i++)
+        asm_word(a, 0);
+    for (int i = 0; i < num_stores; i++)
+        asm_patch(a, stores[i], results + i);
+    asm_insym(a, "mainx20", 0);
+    asm_write(a, path);
+    asm_free(a);
+}
+
+// every processor sums 1..1000 and processor 0 stores the sum
+static void build_sum(const char* path)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    asm_ri(&a, LDIMM, 2, 1);
+    asm_ri(&a, LDIMM, 3, 1000);
+    asm_ri(&a, LDIMM, 4, 0);
+    int loop = asm_here(&a);
+    asm_rr(&a, ADDI, 4, 2);
+    asm_rr(&a, ADDI, 1, 4);
+    asm_rrt(&a, BLT, 4, 3, loop);
+    asm_ri(&a, GETPID, 5, 0);
+    asm_ri(&a, LDIMM, 6, 0);
+    int skip = asm_rrt(&a, BGT, 5, 6, 0);
+    int stores[1];
+    stores[0] = asm_rt(&a, STORE, 1, 0);
+    asm_patch(&a, skip, asm_here(&a));
+    asm_word(&a, HALT);
+    finish(&a, stores, 1, path);
+}
+
+// processor 0 stores 1 and halts, then would store 99; the others spin
+static void build_halt(const char* path)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, GETPID, 1, 0);
+    asm_ri(&a, LDIMM, 2, 0);
+    int spin = asm_rrt(&a, BGT, 1, 2, 0);
+    asm_ri(&a, LDIMM, 3, 1);
+    int stores[2];
+    stores[0] = asm_rt(&a, STORE, 3, 0);
+    asm_word(&a, HALT);
+    asm_ri(&a, LDIMM, 3, 99);
+    stores[1] = asm_rt(&a, STORE, 3, 0);
+    asm_word(&a, HALT);
+    asm_patch(&a, spin, asm_here(&a));
+    asm_rt(&a, JMP, 0, asm_here(&a));
+    finish(&a, stores, 2, path);
+}
+
+static void* load(const char* exe, uint64_t budget)
+{
+    int32_t err = 0;
+    char path[64];
+    strcpy(path, exe);
+    void* vm = initVm(&err);
+    if (!vm || !loadExecutableFile(vm, path, &err))
+    {
+        printf("ERROR: Could not load %s (%d)\n", exe, err);
+        exit(1);
+    }
+    setInstructionBudget(vm, budget);
+    return vm;
+}
+
+static void read_results(void* vm, int32_t* out)
+{
+    for (int i = 0; i < RESULTS; i++)
+        getWord(vm, results + i, &out[i]);
+}
+
+static void stack_pointers(uint32_t* sp)
+{
+    for (int i = 0; i < PROCS; i++)
+        sp[i] = VMX20_DEFAULT_MEMORY_WORDS - 16 - i * 1000;
+}
+
+// run exe to the end with budget, resuming at most max_calls - 1 times;
+// returns the number of calls made
+static int run(const char* exe, uint64_t budget, int max_calls, int32_t flags, int* status,
+    int32_t* out)
+{
+    uint32_t sp[PROCS];
+    stack_pointers(sp);
+
+    void* vm = load(exe, budget);
+    int ok = execute(vm, PROCS, sp, status, flags);
+    int calls = 1;
+    while (!ok && calls < max_calls)
+    {
+        ok = resume(vm, status, flags);
+        calls++;
+    }
+    read_results(vm, out);
+    cleanup(vm);
+    return calls;
+}
+
+// Snapshot exe after its first budgeted execute and carry on past the halts
+// in a VM restored from the snapshot. The statuses and result words of both
+// VMs go to status and out, the snapshotted VM's first.
+static void warm_start(const char* exe, int32_t flags, int status[2][PROCS],
+    int32_t out[2][RESULTS])
+{
+    uint32_t sp[PROCS];
+    stack_pointers(sp);
+
+    void* vm = load(exe, 1000);
+    execute(vm, PROCS, sp, status[0], flags);
+    void* snap = snapshot(vm);
+    void* warm = load(exe, 1000);
+    if (!snap || !restore(warm, snap))
+    {
+        printf("ERROR: Could not snapshot %s\n", exe);
+        exit(1);
+    }
+    resumePastHalt(warm, status[1], flags);
+
+    read_results(vm, out[0]);
+    read_results(warm, out[1]);
+    destroySnapshot(snap);
+    cleanup(vm);
+    cleanup(warm);
+}
+
+static int report(const char* check, int32_t flags, int match)
+{
+    printf("%s %d %d\n", check, flags, match);
+    return !match;
+}
+
+int main(int argc, char* argv[])
+{
+    uint64_t budget = argc > 1 ? strtoull(argv[1], NULL, 10) : 100;
+    int32_t flags[] = { 0, VMX20_EXEC_SWITCH_DISPATCH, VMX20_EXEC_JIT, VMX20_EXEC_PROFILE };
+    int num_flags = sizeof(flags) / sizeof(flags[0]);
+
+    printf("check flags match\n");
+    int mismatches = 0;
+    for (int f = 0; f < num_flags; f++)
+    {
+        int status[2][PROCS];
+        int32_t out[2][RESULTS];
+
+        // a budgeted run resumed to the end gives what an unbudgeted one does
+        build_sum("resume_sum.exe");
+        run("resume_sum.exe", 0, 1, flags[f], status[0], out[0]);
+        int calls = run("resume_sum.exe", budget, 1000000, flags[f], status[1], out[1]);
+        mismatches += report("sum", flags[f], calls > 1 &&
+            memcmp(status[0], status[1], sizeof(status[0])) == 0 &&
+            memcmp(out[0], out[1], sizeof(out[0])) == 0 && out[0][0] == 500500);
+
+        // a processor that halted stays halted while another is resumed
+        build_halt("resume_halt.exe");
+        run("resume_halt.exe", 1000, 3, flags[f], status[0], out[0]);
+        mismatches += report("halt", flags[f], status[0][0] == VMX20_NORMAL_TERMINATION &&
+            status[0][1] == VMX20_BUDGET_EXHAUSTED && out[0][0] == 1 && out[0][1] == 0);
+
+        // resumePastHalt does go on past the halt, in a copy of the snapshot
+        warm_start("resume_halt.exe", flags[f], status, out);
+        mismatches += report("warm", flags[f], status[1][0] == VMX20_NORMAL_TERMINATION &&
+            status[1][1] == VMX20_BUDGET_EXHAUSTED && out[0][1] == 0 && out[1][0] == 1 &&
+            out[1][1] == 99);
+    }
+
+    return mismatches != 0;
+}
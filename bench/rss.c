@@ -0,0 +1,131 @@
+// Resident memory per VM.
+//
+// Keeps many VMs alive at once, each having run a small stack-using
+// program, and reports how much of each address space is resident, both
+// with the default sparse memory and with VMX20_MEM_DENSE. Then runs one
+// big-heap VM that writes a word on every page of a large address space.
+//
+// Usage: ./rss [vms] [big_heap_words]
+
+#define _GNU_SOURCE
+#include <unistd.h>
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+// push and pop a few values, then halt
+static void build_small(const char* path)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    asm_ri(&a, LDIMM, 2, 1);
+    asm_ri(&a, LDIMM, 3, 64);
+    int loop = asm_here(&a);
+    asm_ri(&a, PUSH, 1, 0);
+    asm_ri(&a, POP, 4, 0);
+    asm_rr(&a, ADDI, 1, 2);
+    asm_rrt(&a, BLT, 1, 3, loop);
+    asm_word(&a, HALT);
+    asm_insym(&a, "mainx20", 0);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+// store to one word per 16K from the end of the code up to words
+static void build_big(const char* path, uint32_t words)
+{
+    Asm a;
+    asm_init(&a);
+    int start = asm_rt(&a, LDADDR, 1, 0);
+    asm_ri(&a, LDIMM, 2, 16384);
+    asm_ri(&a, LDIMM, 3, words / 16384);
+    asm_rr(&a, MULI, 3, 2);
+    asm_rr(&a, SUBI, 3, 2);
+    int loop = asm_here(&a);
+    asm_rro(&a, STIND, 2, 1, 0);
+    asm_rr(&a, ADDI, 1, 2);
+    asm_rrt(&a, BLT, 1, 3, loop);
+    asm_word(&a, HALT);
+    asm_patch(&a, start, asm_word(&a, 0));
+    asm_insym(&a, "mainx20", 0);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+static double process_rss_mb()
+{
+    long pages = 0;
+    FILE* file = fopen("/proc/self/statm", "r");
+    if (file)
+    {
+        if (fscanf(file, "%*s %ld", &pages) != 1)
+            pages = 0;
+        fclose(file);
+    }
+    return pages * (double) sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void* run(const char* exe, uint32_t words, int32_t flags)
+{
+    int32_t err = 0;
+    char path[64];
+    strcpy(path, exe);
+    void* vm = initVmSized(words, flags, &err);
+    if (!vm || !loadExecutableFile(vm, path, &err))
+    {
+        printf("ERROR: Could not load %s (%d)\n", exe, err);
+        exit(1);
+    }
+
+    uint32_t sp = words - 16;
+    int status;
+    execute(vm, 1, &sp, &status, 0);
+    if (status != VMX20_NORMAL_TERMINATION)
+    {
+        printf("ERROR: %s terminated with %d\n", exe, status);
+        exit(1);
+    }
+    return vm;
+}
+
+int main(int argc, char* argv[])
+{
+    int vms = argc > 1 ? atoi(argv[1]) : 200;
+    uint32_t big_words = argc > 2 ? (uint32_t) atol(argv[2]) : 64u << 20;
+
+    build_small("rss_small.exe");
+    build_big("rss_big.exe", big_words);
+
+    printf("mode vms memory_words resident_kb_per_vm process_rss_mb\n");
+    int32_t modes[2] = { 0, VMX20_MEM_DENSE };
+    const char* names[2] = { "sparse", "dense" };
+    for (int m = 0; m < 2; m++)
+    {
+        // dense VMs commit everything, so only a handful are kept alive
+        int count = modes[m] & VMX20_MEM_DENSE ? (vms < 4 ? vms : 4) : vms;
+        void** handles = (void**) malloc(sizeof(void*) * count);
+        uint64_t resident = 0;
+        for (int i = 0; i < count; i++)
+        {
+            handles[i] = run("rss_small.exe", VMX20_DEFAULT_MEMORY_WORDS, modes[m]);
+            uint64_t bytes = 0;
+            getResidentBytes(handles[i], &bytes);
+            resident += bytes;
+        }
+        printf("%s %d %d %.1f %.1f\n", names[m], count, VMX20_DEFAULT_MEMORY_WORDS,
+            resident / 1024.0 / count, process_rss_mb());
+        for (int i = 0; i < count; i++)
+            cleanup(handles[i]);
+        free(handles);
+    }
+
+    void* vm = run("rss_big.exe", big_words, 0);
+    uint64_t bytes = 0;
+    getResidentBytes(vm, &bytes);
+    printf("big-heap 1 %u %.1f %.1f\n", big_words, bytes / 1024.0, process_rss_mb());
+    cleanup(vm);
+
+    return 0;
+}
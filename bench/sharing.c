@@ -0,0 +1,110 @@
+// False sharing check.
+//
+// Two processors each write their own word, the pair picked so that both
+// words sit in one host cache line while falling in different groups of
+// VMX20_CACHE_LINE_WORDS counted from word 0. executeWithStats must report
+// them as one hot line with no shared words. Exits with 1 on a mismatch.
+//
+// Usage: ./sharing [iterations]
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#define PROCS 2
+
+// address of the word holding the first processor's target
+static int target;
+
+// every processor writes 0 .. n - 1 to word [target] + pid
+static void build_writers(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, GETPID, 1, 0);
+    int load = asm_rt(&a, LOAD, 2, 0);
+    asm_rr(&a, ADDI, 2, 1);
+    asm_ri(&a, LDIMM, 3, 0);
+    asm_ri(&a, LDIMM, 4, 1);
+    asm_ri(&a, LDIMM, 5, n);
+    int loop = asm_here(&a);
+    asm_rro(&a, STIND, 3, 2, 0);
+    asm_rr(&a, ADDI, 3, 4);
+    asm_rrt(&a, BLT, 3, 5, loop);
+    asm_word(&a, HALT);
+    target = asm_word(&a, 0);
+    asm_patch(&a, load, target);
+    asm_insym(&a, "mainx20", 0);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+// host cache line of the word at address
+static uintptr_t host_line(void* vm, uint32_t address)
+{
+    MemoryView view;
+    if (!getMemoryView(vm, address, 1, 0, &view))
+    {
+        printf("ERROR: Could not view word %u\n", address);
+        exit(1);
+    }
+    return (uintptr_t) view.data / (sizeof(int32_t) * VMX20_CACHE_LINE_WORDS);
+}
+
+int main(int argc, char* argv[])
+{
+    int n = argc > 1 ? atoi(argv[1]) : 100000;
+    char path[] = "sharing.exe";
+    build_writers(path, n);
+
+    int32_t err = 0;
+    void* vm = initVm(&err);
+    if (!vm || !loadExecutableFile(vm, path, &err))
+    {
+        printf("ERROR: Could not load %s (%d)\n", path, err);
+        exit(1);
+    }
+
+    // the last word of a group of VMX20_CACHE_LINE_WORDS whose host line
+    // goes on into the next group
+    uint32_t first = 0;
+    for (uint32_t a = 1024 + VMX20_CACHE_LINE_WORDS - 1; a < 1024 + 4 * VMX20_CACHE_LINE_WORDS;
+            a += VMX20_CACHE_LINE_WORDS)
+    {
+        if (host_line(vm, a) == host_line(vm, a + 1))
+        {
+            first = a;
+            break;
+        }
+    }
+    if (!first)
+    {
+        printf("ERROR: VM memory starts on a host cache line\n");
+        exit(1);
+    }
+    int32_t word = first;
+    putWords(vm, target, 1, &word);
+
+    uint32_t sp[PROCS];
+    for (int i = 0; i < PROCS; i++)
+        sp[i] = VMX20_DEFAULT_MEMORY_WORDS - 16 - i * 1000;
+    int status[PROCS];
+    ProcStats procs[PROCS];
+    SharingStats sharing;
+    executeWithStats(vm, PROCS, sp, status, 0, procs, &sharing);
+
+    // one line holding both words, which no two processors share
+    int match = 0;
+    for (uint32_t i = 0; i < sharing.numHotLines; i++)
+    {
+        SharedStats* line = &sharing.hotLines[i];
+        if (line->address <= first && first + 1 < line->address + VMX20_CACHE_LINE_WORDS &&
+                line->processors == PROCS && line->sharedWords == 0 &&
+                line->writes == (uint64_t) n * PROCS)
+            match = 1;
+    }
+    printf("words %u %u lines %u match %d\n", first, first + 1, sharing.numHotLines, match);
+
+    cleanup(vm);
+    return !match;
+}
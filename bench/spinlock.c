@@ -0,0 +1,117 @@
+// Multi-processor spin-lock benchmark.
+//
+// Every simulated processor sums a shared read-only table word WORK times,
+// then takes a cmpxchg spin lock to add its partial sum to a shared
+// counter, ITERS times over. Reports throughput for 1 to N processors.
+//
+// Usage: ./spinlock [max_procs] [iters] [work]
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+
+#include "asmx20.h"
+#include "vmx20.h"
+
+static int counter_addr;
+
+static void build(const char* path, int iters, int work)
+{
+    Asm a;
+    asm_init(&a);
+
+    asm_ri(&a, LDIMM, 0, 0);
+    asm_ri(&a, LDIMM, 6, 1);
+    asm_ri(&a, LDIMM, 7, iters);
+    asm_ri(&a, LDIMM, 8, 0);
+    asm_ri(&a, LDIMM, 10, work);
+
+    int outer = asm_here(&a);
+    asm_ri(&a, LDIMM, 11, 0);
+    asm_ri(&a, LDIMM, 12, 0);
+    int inner = asm_here(&a);
+    int table = asm_rt(&a, LOAD, 3, 0);
+    asm_rr(&a, ADDI, 12, 3);
+    asm_rr(&a, ADDI, 11, 6);
+    asm_rrt(&a, BLT, 11, 10, inner);
+
+    // spin until cmpxchg swaps the lock from 0 to 1
+    int spin = asm_here(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    asm_ri(&a, LDIMM, 2, 1);
+    int lock = asm_rrt(&a, CMPXCHG, 1, 2, 0);
+    int acquired = asm_rrt(&a, BEQ, 1, 0, 0);
+    asm_rrt(&a, BEQ, 0, 0, spin);
+    asm_patch(&a, acquired, asm_here(&a));
+    int load_counter = asm_rt(&a, LOAD, 3, 0);
+    asm_rr(&a, ADDI, 3, 12);
+    int store_counter = asm_rt(&a, STORE, 3, 0);
+    int unlock = asm_rt(&a, STORE, 0, 0);
+    asm_rr(&a, ADDI, 8, 6);
+    asm_rrt(&a, BLT, 8, 7, outer);
+    asm_word(&a, HALT);
+
+    asm_patch(&a, table, asm_word(&a, 1));
+    int lock_word = asm_word(&a, 0);
+    asm_patch(&a, lock, lock_word);
+    asm_patch(&a, unlock, lock_word);
+    counter_addr = asm_word(&a, 0);
+    asm_patch(&a, load_counter, counter_addr);
+    asm_patch(&a, store_counter, counter_addr);
+
+    asm_insym(&a, "mainx20", 0);
+    asm_insym(&a, "counter", counter_addr);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_procs = argc > 1 ? atoi(argv[1]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int iters = argc > 2 ? atoi(argv[2]) : 20000;
+    int work = argc > 3 ? atoi(argv[3]) : 50;
+
+    build("spinlock.exe", iters, work);
+
+    printf("procs seconds iters_per_sec speedup counter_ok\n");
+    double base = 0;
+    for (int procs = 1; procs <= max_procs; procs++)
+    {
+        int32_t err = 0;
+        char path[] = "spinlock.exe";
+        void* vm = initVm(&err);
+        if (!vm || !loadExecutableFile(vm, path, &err))
+        {
+            printf("ERROR: Could not load spinlock.exe (%d)\n", err);
+            exit(1);
+        }
+
+        uint32_t sp[procs];
+        int status[procs];
+        for (int i = 0; i < procs; i++)
+            sp[i] = 1000000 + i * 1000;
+
+        double start = now();
+        execute(vm, procs, sp, status, 0);
+        double secs = now() - start;
+
+        int32_t counter = 0;
+        getWord(vm, counter_addr, &counter);
+        cleanup(vm);
+
+        double rate = (double) procs * iters / secs;
+        if (procs == 1)
+            base = rate;
+        printf("%d %.4f %.0f %.2f %d\n", procs, secs, rate, rate / base,
+            counter == procs * iters * work);
+    }
+
+    return 0;
+}
@@ -0,0 +1,387 @@
+// Benchmark suite for the VM and the linker.
+//
+// Generates its programs, runs each one and writes one
+// "benchmark procs metric value" line per measurement to the results file,
+// for diffing against an earlier run:
+//
+//   int       tight integer loop
+//   float     float multiply/add/divide kernel
+//   fib       recursive fib through call/ret
+//   stack     push/pop heavy loop
+//   spinlock  every processor adds to a counter under a cmpxchg spin lock
+//   link      a chain of many modules linked with linkx20, then run
+//
+// Instruction counts come from an untimed executeWithStats run of the same
+// program; the timed run uses execute with the given flags. int and
+// spinlock are also run on 1, 2, 4, ... processors up to max_procs for the
+// thread scaling curve.
+//
+// Usage: ./suite [results] [scale] [max_procs] [exec_flags] [modules]
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "asmx20.h"
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#define LINKER "../linker/linkx20"
+
+// words of filler per linked module, and the insymbols each one defines
+#define MODULE_WORDS 2048
+#define MODULE_SYMS 16
+
+// r = count, built with a multiply since ldimm only reaches 2^19; uses r13
+static void load_count(Asm* a, int r, int count)
+{
+    asm_ri(a, LDIMM, r, count / 1000 > 0 ? count / 1000 : 1);
+    asm_ri(a, LDIMM, 13, count / 1000 > 0 ? 1000 : count);
+    asm_rr(a, MULI, r, 13);
+}
+
+static void finish(Asm* a, const char* path)
+{
+    asm_insym(a, "mainx20", 0);
+    asm_write(a, path);
+    asm_free(a);
+}
+
+// sum of i*i for i below n
+static void build_int(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n);
+    asm_ri(&a, LDIMM, 3, 1);
+    asm_ri(&a, LDIMM, 4, 0);
+    int loop = asm_here(&a);
+    asm_ri(&a, LDIMM, 5, 0);
+    asm_rr(&a, ADDI, 5, 1);
+    asm_rr(&a, MULI, 5, 5);
+    asm_rr(&a, ADDI, 4, 5);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    asm_word(&a, HALT);
+    finish(&a, path);
+}
+
+// x = (x * 0.999 + 0.001) / 1.0, n times
+static void build_float(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    int consts[4];
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n);
+    asm_ri(&a, LDIMM, 3, 1);
+    for (int i = 0; i < 4; i++)
+        consts[i] = asm_rt(&a, LOAD, 4 + i, 0);
+    int loop = asm_here(&a);
+    asm_rr(&a, MULF, 4, 5);
+    asm_rr(&a, ADDF, 4, 6);
+    asm_rr(&a, DIVF, 4, 7);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    asm_word(&a, HALT);
+
+    float values[4] = { 1.0f, 0.999f, 0.001f, 1.0f };
+    for (int i = 0; i < 4; i++)
+    {
+        int32_t bits;
+        memcpy(&bits, &values[i], 4);
+        asm_patch(&a, consts[i], asm_word(&a, bits));
+    }
+    finish(&a, path);
+}
+
+// fib(n) with the argument in r1 and the result in r0
+static void build_fib(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, n);
+    int call = asm_rt(&a, CALL, 0, 0);
+    asm_word(&a, HALT);
+
+    int fib = asm_here(&a);
+    asm_patch(&a, call, fib);
+    asm_ri(&a, LDIMM, 2, 2);
+    int small = asm_rrt(&a, BLT, 1, 2, 0);
+    asm_ri(&a, PUSH, 1, 0);
+    asm_ri(&a, LDIMM, 3, -1);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rt(&a, CALL, 0, fib);
+    asm_ri(&a, POP, 1, 0);
+    asm_ri(&a, PUSH, 0, 0);
+    asm_ri(&a, PUSH, 1, 0);
+    asm_ri(&a, LDIMM, 3, -2);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rt(&a, CALL, 0, fib);
+    asm_ri(&a, POP, 1, 0);
+    asm_ri(&a, POP, 2, 0);
+    asm_rr(&a, ADDI, 0, 2);
+    asm_word(&a, RET);
+    asm_patch(&a, small, asm_here(&a));
+    asm_ri(&a, LDIMM, 0, 0);
+    asm_rr(&a, ADDI, 0, 1);
+    asm_word(&a, RET);
+    finish(&a, path);
+}
+
+// push three registers and pop them back, n times
+static void build_stack(const char* path, int n)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    load_count(&a, 2, n);
+    asm_ri(&a, LDIMM, 3, 1);
+    int loop = asm_here(&a);
+    asm_ri(&a, PUSH, 1, 0);
+    asm_ri(&a, PUSH, 2, 0);
+    asm_ri(&a, PUSH, 3, 0);
+    asm_ri(&a, POP, 3, 0);
+    asm_ri(&a, POP, 2, 0);
+    asm_ri(&a, POP, 4, 0);
+    asm_rr(&a, ADDI, 1, 3);
+    asm_rrt(&a, BLT, 1, 2, loop);
+    asm_word(&a, HALT);
+    finish(&a, path);
+}
+
+// iters times: take the lock, bump the shared counter, release the lock
+static void build_spinlock(const char* path, int iters)
+{
+    Asm a;
+    asm_init(&a);
+    asm_ri(&a, LDIMM, 0, 0);
+    asm_ri(&a, LDIMM, 6, 1);
+    load_count(&a, 7, iters);
+    asm_ri(&a, LDIMM, 8, 0);
+
+    int outer = asm_here(&a);
+    int spin = asm_here(&a);
+    asm_ri(&a, LDIMM, 1, 0);
+    asm_ri(&a, LDIMM, 2, 1);
+    int lock = asm_rrt(&a, CMPXCHG, 1, 2, 0);
+    int acquired = asm_rrt(&a, BEQ, 1, 0, 0);
+    asm_rrt(&a, BEQ, 0, 0, spin);
+    asm_patch(&a, acquired, asm_here(&a));
+    int load_counter = asm_rt(&a, LOAD, 3, 0);
+    asm_rr(&a, ADDI, 3, 6);
+    int store_counter = asm_rt(&a, STORE, 3, 0);
+    int unlock = asm_rt(&a, STORE, 0, 0);
+    asm_rr(&a, ADDI, 8, 6);
+    asm_rrt(&a, BLT, 8, 7, outer);
+    asm_word(&a, HALT);
+
+    int lock_word = asm_word(&a, 0);
+    asm_patch(&a, lock, lock_word);
+    asm_patch(&a, unlock, lock_word);
+    int counter = asm_word(&a, 0);
+    asm_patch(&a, load_counter, counter);
+    asm_patch(&a, store_counter, counter);
+    finish(&a, path);
+}
+
+// module i defines f<i> (and MODULE_SYMS - 1 more insymbols), which runs
+// MODULE_WORDS words of arithmetic and calls f<i+1> through an outsymbol;
+// module 0 holds mainx20, which calls f1
+static void build_module(const char* path, int i, int modules)
+{
+    Asm a;
+    asm_init(&a);
+    char name[16];
+
+    if (i == 0)
+        asm_insym(&a, "mainx20", 0);
+    else
+    {
+        sprintf(name, "f%d", i);
+        asm_insym(&a, name, 0);
+    }
+
+    int stride = MODULE_WORDS / MODULE_SYMS;
+    for (int w = 0; w < MODULE_WORDS; w++)
+    {
+        if (w > 0 && w % stride == 0)
+        {
+            sprintf(name, "m%d_s%d", i, w / stride);
+            asm_insym(&a, name, asm_here(&a));
+        }
+        if (w % 2 == 0)
+            asm_ri(&a, LDIMM, 1, w);
+        else
+            asm_rr(&a, ADDI, 2, 1);
+    }
+
+    if (i + 1 < modules)
+    {
+        sprintf(name, "f%d", i + 1);
+        asm_outsym(&a, name, asm_word(&a, CALL));
+    }
+    asm_word(&a, i == 0 ? HALT : RET);
+    asm_write(&a, path);
+    asm_free(&a);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// results go to a file of their own, apart from errors on stdout
+static FILE* results;
+
+static void report(const char* bench, int procs, const char* metric, double value)
+{
+    fprintf(results, "%s %d %s %.6g\n", bench, procs, metric, value);
+    fflush(results);
+}
+
+static void* load(const char* exe)
+{
+    int32_t err = 0;
+    char path[64];
+    strcpy(path, exe);
+    void* vm = initVm(&err);
+    if (!vm || !loadExecutableFile(vm, path, &err))
+    {
+        printf("ERROR: Could not load %s (%d)\n", exe, err);
+        exit(1);
+    }
+    return vm;
+}
+
+// run exe on procs processors, reporting its instruction rate
+static double run(const char* bench, const char* exe, int procs, int32_t flags)
+{
+    uint32_t sp[procs];
+    int status[procs];
+    ProcStats stats[procs];
+    SharingStats sharing;
+    for (int i = 0; i < procs; i++)
+        sp[i] = VMX20_DEFAULT_MEMORY_WORDS - 16 - i * 100000;
+
+    void* vm = load(exe);
+    executeWithStats(vm, procs, sp, status, 0, stats, &sharing);
+    cleanup(vm);
+    double instructions = 0;
+    for (int i = 0; i < procs; i++)
+        instructions += stats[i].instructions;
+
+    vm = load(exe);
+    double start = now();
+    int ok = execute(vm, procs, sp, status, flags);
+    double secs = now() - start;
+    cleanup(vm);
+    if (!ok)
+    {
+        printf("ERROR: %s terminated with %d\n", exe, status[0]);
+        exit(1);
+    }
+
+    report(bench, procs, "instructions", instructions);
+    report(bench, procs, "seconds", secs);
+    report(bench, procs, "insns_per_sec", instructions / secs);
+    return instructions / secs;
+}
+
+// run exe on 1, 2, 4, ... processors
+static void scale(const char* bench, const char* exe, int max_procs, int32_t flags)
+{
+    double base = 0;
+    for (int procs = 1; procs <= max_procs; procs *= 2)
+    {
+        double rate = run(bench, exe, procs, flags);
+        if (procs == 1)
+            base = rate;
+        report(bench, procs, "speedup", rate / base);
+    }
+}
+
+// link the module chain with linkx20, reporting its time and peak RSS
+static void link_modules(int modules, int32_t flags)
+{
+    char** argv = (char**) malloc(sizeof(char*) * (modules + 4));
+    argv[0] = LINKER;
+    for (int i = 0; i < modules; i++)
+    {
+        argv[i + 1] = (char*) malloc(32);
+        sprintf(argv[i + 1], "link_m%d.obj", i);
+        build_module(argv[i + 1], i, modules);
+    }
+    argv[modules + 1] = "-o";
+    argv[modules + 2] = "link_out";
+    argv[modules + 3] = NULL;
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        execv(LINKER, argv);
+        printf("ERROR: Could not run %s\n", LINKER);
+        _exit(1);
+    }
+
+    int wstatus = 0;
+    struct rusage usage;
+    if (pid < 0 || wait4(pid, &wstatus, 0, &usage) != pid || !WIFEXITED(wstatus) ||
+            WEXITSTATUS(wstatus) != 0)
+    {
+        printf("ERROR: Linking %d modules failed\n", modules);
+        exit(1);
+    }
+    double secs = now() - start;
+
+    report("link", 1, "modules", modules);
+    report("link", 1, "link_seconds", secs);
+    report("link", 1, "link_peak_rss_kb", usage.ru_maxrss);
+    run("link", "link_out.exe", 1, flags);
+
+    for (int i = 0; i < modules; i++)
+        free(argv[i + 1]);
+    free(argv);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* path = argc > 1 ? argv[1] : "suite.txt";
+    int scale_n = argc > 2 ? atoi(argv[2]) : 20000000;
+    int max_procs = argc > 3 ? atoi(argv[3]) : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int32_t flags = argc > 4 ? atoi(argv[4]) : 0;
+    int modules = argc > 5 ? atoi(argv[5]) : 500;
+
+    results = fopen(path, "w");
+    if (!results)
+    {
+        printf("ERROR: Could not make output file %s\n", path);
+        exit(1);
+    }
+
+    build_int("suite_int.exe", scale_n);
+    build_float("suite_float.exe", scale_n);
+    build_fib("suite_fib.exe", 27);
+    build_stack("suite_stack.exe", scale_n / 4);
+    build_spinlock("suite_spinlock.exe", scale_n / 100);
+
+    fprintf(results, "benchmark procs metric value\n");
+    scale("int", "suite_int.exe", max_procs, flags);
+    run("float", "suite_float.exe", 1, flags);
+    run("fib", "suite_fib.exe", 1, flags);
+    run("stack", "suite_stack.exe", 1, flags);
+    scale("spinlock", "suite_spinlock.exe", max_procs, flags);
+    link_modules(modules, flags);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    report("suite", 1, "peak_rss_kb", usage.ru_maxrss);
+    fclose(results);
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Batch driver: runs many .exe files through a VM pool.
+//
+// Usage: ./batchx20 [-p processors] [-r repeat] [-m memoryWords] <file1.exe>...<fileN.exe>
+
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// words of stack given to each simulated processor, counted down from the top of memory
+#define STACK_WORDS 4096
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t processors = 1;
+    int repeat = 1;
+    uint32_t memory_words = VMX20_DEFAULT_MEMORY_WORDS;
+
+    int arg = 1;
+    for (; arg < argc - 1 && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "-p") == 0)
+            processors = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-r") == 0)
+            repeat = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-m") == 0)
+            memory_words = strtoul(argv[arg + 1], NULL, 10);
+        else
+            break;
+    }
+
+    if (arg >= argc || processors < 1 || processors * STACK_WORDS >= memory_words)
+    {
+        printf("ERROR: Usage ./batchx20 [-p processors] [-r repeat] [-m memoryWords] <file1.exe>...<fileN.exe>\n");
+        exit(1);
+    }
+
+    int32_t err = 0;
+    void* pool = createVmPool(1, memory_words, 0, &err);
+    if (!pool)
+    {
+        printf("ERROR: Could not create VM pool (%d)\n", err);
+        exit(1);
+    }
+
+    uint32_t sp[processors];
+    int status[processors];
+    for (uint32_t i = 0; i < processors; i++)
+        sp[i] = memory_words - 1 - i * STACK_WORDS;
+
+    int runs = 0;
+    int failures = 0;
+    double start = now();
+    for (int r = 0; r < repeat; r++)
+    {
+        for (int i = arg; i < argc; i++)
+        {
+            void* vm = acquireVm(pool, argv[i], &err);
+            if (!vm)
+            {
+                printf("%s: load error %d\n", argv[i], err);
+                failures++;
+                continue;
+            }
+
+            if (!execute(vm, processors, sp, status, 0))
+            {
+                printf("%s: terminated with", argv[i]);
+                for (uint32_t p = 0; p < processors; p++)
+                    printf(" %d", status[p]);
+                printf("\n");
+                failures++;
+            }
+            releaseVm(pool, vm);
+            runs++;
+        }
+    }
+    double secs = now() - start;
+
+    printf("runs %d failures %d seconds %.4f runs_per_sec %.0f\n", runs, failures, secs,
+        secs > 0 ? runs / secs : 0);
+
+    destroyVmPool(pool);
+    return failures != 0;
+}
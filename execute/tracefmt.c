@@ -0,0 +1,64 @@
+// Trace formatter: renders a binary trace written by execute in the
+// text format the interpreter used to print.
+//
+// Usage: ./tracefmt <file.trace>
+
+#include "vmx20.h"
+#include "vmx20ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// records read from the trace file at a time
+#define BLOCK_RECORDS 4096
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2)
+    {
+        printf("ERROR: Usage ./tracefmt <file.trace>\n");
+        exit(1);
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (!file)
+    {
+        printf("ERROR: Could not open %s\n", argv[1]);
+        exit(1);
+    }
+
+    uint32_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != VMX20_TRACE_MAGIC)
+    {
+        printf("ERROR: %s is not a trace file\n", argv[1]);
+        exit(1);
+    }
+
+    TraceRecord* block = (TraceRecord*) malloc(sizeof(TraceRecord) * BLOCK_RECORDS);
+    if (!block)
+    {
+        printf("ERROR: Could not allocate read buffer\n");
+        exit(1);
+    }
+
+    size_t count;
+    while ((count = fread(block, sizeof(TraceRecord), BLOCK_RECORDS, file)) > 0)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            TraceRecord* rec = &block[i];
+            int32_t* regs = rec->regs;
+            char buffer[100];
+            int32_t errNum = 0;
+            if (!disassembleWord(rec->word, buffer, &errNum))
+                buffer[0] = '\0';
+            printf("%s<%d> %08x %08x %08x %08x %08x %08x %08x %08x\n%08x %08x %08x %08x %08x %08x %08x %08x\n",
+                buffer, rec->pid, regs[0], regs[1], regs[2], regs[3], regs[4], regs[5], regs[6],
+                regs[7], regs[8], regs[9], regs[10], regs[11], regs[12], regs[13], regs[14], regs[15]);
+        }
+    }
+
+    free(block);
+    fclose(file);
+    return 0;
+}
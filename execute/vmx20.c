@@ -1,140 +1,667 @@
+#define _GNU_SOURCE
 #include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-typedef struct {
-    int32_t insym_size;
-    int32_t outsym_size;
-    int32_t code_size;
-} Header;
-
-typedef struct {
-    char name[16];
-    int32_t addr;
-} Sym;
-
-typedef struct {
-    Header hdr;
-    Sym* syms;
-    int32_t* mem;
-    pthread_mutex_t data_lock;
-    pthread_mutex_t trace_lock;
-} VM;
-
-typedef struct {
-    VM* handle;
-    uint32_t initialSP;
-    int* terminationStatus;
-    int32_t trace;
-    int pid;
-    int pn;
-} ThreadArgs;
-
-void* execute_helper(void* args);
+// Shared memory words are read and written through C11 atomics so that
+// simulated processors never serialize on a lock. Plain loads and stores
+// use acquire/release ordering, which costs nothing extra on x86-64.
+#define MEM_LOAD(p)     atomic_load_explicit((_Atomic int32_t*) (p), memory_order_acquire)
+#define MEM_STORE(p, v) atomic_store_explicit((_Atomic int32_t*) (p), (v), memory_order_release)
+
+// Pre-decoded entries are shared too. While processors run, an entry only
+// changes by being marked stale, a release store of its handler and of its
+// op; its operands are only rewritten between runs. So whichever of handler
+// or op an interpreter loads, the operands it then reads go with it.
+#define INSN_OP(ip)         atomic_load_explicit((_Atomic uint8_t*) &(ip)->op, memory_order_acquire)
+#define INSN_HANDLER(ip)    atomic_load_explicit((void* _Atomic*) &(ip)->handler, memory_order_acquire)
+
+void** threaded_handlers;
+#ifndef VMX20_NO_THREADED
+static pthread_once_t threaded_once = PTHREAD_ONCE_INIT;
+#endif
+
+// sign extend the low bits of a field
+static inline int32_t sext(uint32_t field, int bits)
+{
+    uint32_t sign = 1u << (bits - 1);
+    field &= (sign << 1) - 1;
+    return (int32_t) ((field ^ sign) - sign);
+}
+
+void decode_word(Insn* insn, int32_t word, int32_t index)
+{
+    insn->op = word & 0xff;
+    insn->r1 = (word >> 8) & 0xf;
+    insn->r2 = (word >> 12) & 0xf;
+    insn->rx = 0;
+
+    switch (insn->op)
+    {
+        case 1:     // load
+        case 2:     // store
+        case 4:     // ldaddr
+        case 15:    // call
+        case 20:    // jmp
+            insn->imm = sext(word >> 12, 20) + index + 1;
+            break;
+        case 3:     // ldimm
+            insn->imm = sext(word >> 12, 20);
+            break;
+        case 5:     // ldind
+        case 6:     // stind
+            insn->imm = sext(word >> 16, 16);
+            break;
+        case 17:    // blt
+        case 18:    // bgt
+        case 19:    // beq
+        case 21:    // cmpxchg
+            insn->imm = sext(word >> 16, 16) + index + 1;
+            break;
+        default:
+            insn->imm = 0;
+            if (insn->op >= OP_FUSED_BASE)
+                insn->op = OP_ILLEGAL;
+            break;
+    }
+
+    insn->handler = threaded_handlers ? threaded_handlers[insn->op] : NULL;
+}
+
+// make an entry decode its word from memory whenever it is run
+static inline void mark_stale(Insn* insn)
+{
+    if (threaded_handlers)
+        atomic_store_explicit((void* _Atomic*) &insn->handler, threaded_handlers[OP_STALE],
+            memory_order_release);
+    atomic_store_explicit((_Atomic uint8_t*) &insn->op, OP_STALE, memory_order_release);
+}
+
+// drop the pre-decoded entry of a code word after it has been written
+static inline void invalidate_word(VM* vm, uint32_t addr)
+{
+    if (addr <= vm->hdr.code_size)
+    {
+        mark_stale(&vm->insns[addr]);
+        // so are fused instructions whose sequence covers the word. A
+        // processor already in one runs it from operands decoded before
+        // the write, as if the write had come after the whole sequence.
+        for (uint32_t i = addr > 2 ? addr - 2 : 0; i < addr; i++)
+        {
+            uint8_t op = INSN_OP(&vm->insns[i]);
+            if (op >= OP_FUSED_BASE && op < OP_ILLEGAL)
+                mark_stale(&vm->insns[i]);
+        }
+        // compiled blocks holding the word are thrown away by each processor
+        if (vm->jit_words && atomic_load_explicit((_Atomic uint8_t*) &vm->jit_words[addr],
+                memory_order_seq_cst) == JIT_WORD_COMPILED)
+        {
+            atomic_store_explicit((_Atomic uint8_t*) &vm->jit_words[addr], JIT_WORD_WRITTEN,
+                memory_order_relaxed);
+            atomic_fetch_add_explicit(&vm->jit_epoch, 1, memory_order_seq_cst);
+        }
+    }
+}
+
+// The last page mapped from the file goes on past the code, into whatever
+// follows it there (the symbol index and trailer of a version 2 file). That
+// part is ordinary VM memory and reads as zero, as it does when memory is
+// read in instead of mapped.
+static void clear_past_code(VM* vm)
+{
+    Image* img = vm->image;
+    off_t code_end = img->code_offset + sizeof(int32_t) * (off_t) vm->hdr.code_size;
+    if (!vm->map_base || img->size <= code_end)
+        return;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    char* base = (char*) vm->map_base;
+    char* from = (char*) (vm->mem + vm->hdr.code_size);
+    char* to = base + ((from - base) + page - 1) / page * page;
+    if (to > base + vm->map_len)
+        to = base + vm->map_len;
+    if (to - from > img->size - code_end)
+        to = from + (img->size - code_end);
+    memset(from, 0, to - from);
+}
+
+#ifndef VMX20_NO_MMAP
+// Map the address space: the code section is mapped copy-on-write straight
+// from the file, the rest is an anonymous reservation that is only committed
+// as pages are touched (or up front for VMX20_MEM_DENSE). The file offset of
+// the code section is rarely page aligned, so the mapping starts at the
+// enclosing page and mem points into it.
+// Returns 0 if the file can't be mapped, so the caller can read it instead.
+static int map_memory(VM* vm, int fd, long code_offset)
+{
+    struct stat st;
+    size_t code_bytes = sizeof(int32_t) * vm->hdr.code_size;
+    if (fstat(fd, &st) != 0 || st.st_size < code_offset + (off_t) code_bytes)
+        return 0;
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t skew = code_offset % page;
+    size_t len = (skew + sizeof(int32_t) * vm->mem_words + page - 1) / page * page;
+    int populate = (vm->flags & VMX20_MEM_DENSE) ? MAP_POPULATE : MAP_NORESERVE;
+    char* base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+    if (base == MAP_FAILED)
+        return 0;
+
+    if (code_bytes > 0)
+    {
+        size_t file_len = (skew + code_bytes + page - 1) / page * page;
+        if (mmap(base, file_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, code_offset - skew) == MAP_FAILED)
+        {
+            munmap(base, len);
+            return 0;
+        }
+    }
+
+    vm->map_base = base;
+    vm->map_len = len;
+    vm->mem = (int32_t*) (base + skew);
+    clear_past_code(vm);
+    return 1;
+}
+#endif
+
+// per-step work of traced runs and of runs counting opcode pairs
+static void observe_step(VM* vm, Proc* p, int32_t* regs)
+{
+    if (vm->exec_flags & VMX20_EXEC_TRACE)
+        trace_step(vm, p->pid, regs);
+
+    if (vm->exec_flags & VMX20_EXEC_PAIRS)
+    {
+        int op = vm->mem[regs[15] - 1] & 0xff;
+        if (op < VMX20_NUM_OPCODES)
+        {
+            if (p->last_op >= 0)
+                p->pairs[p->last_op][op]++;
+            p->last_op = op;
+        }
+        else
+            p->last_op = -1;
+    }
+}
+
+// profiler counts of the instrumented interpreter for the instruction at pc
+static inline void profile_step(VM* vm, ProcProfile* prof, uint32_t pc)
+{
+    int op = VMX20_NUM_OPCODES;
+    if (pc <= vm->hdr.code_size && (uint32_t) (vm->mem[pc] & 0xff) < VMX20_NUM_OPCODES)
+        op = vm->mem[pc] & 0xff;
+    prof->ops[op]++;
+    prof->hits[pc]++;
+    prof->nodes[prof->node].self++;
+}
+
+#define INTERP_NAME run_switch
+#define INTERP_THREADED 0
+#include "vmx20interp.inc"
+
+#ifndef VMX20_NO_THREADED
+#define INTERP_NAME run_threaded
+#define INTERP_THREADED 1
+#include "vmx20interp.inc"
+
+static void init_threaded_handlers()
+{
+    run_threaded(NULL, NULL, 0);
+}
+#endif
+
+// dispatches through the switch, since Insn.handler points into run_threaded
+#define INTERP_NAME run_instrumented
+#define INTERP_THREADED 0
+#define INTERP_INSTRUMENTED 1
+#include "vmx20interp.inc"
 
 void *initVm(int32_t *errorNumber)
 {
-    printf("INIT VM\n");
-    VM* vm = (VM*) malloc(sizeof(VM));
+    return initVmSized(VMX20_DEFAULT_MEMORY_WORDS, 0, errorNumber);
+}
+
+void *initVmSized(uint32_t memoryWords, int32_t flags, int32_t *errorNumber)
+{
+    VM* vm = (VM*) calloc(1, sizeof(VM));
+
+    if (!vm || memoryWords < 2) 
+    {
+        free(vm);
+        (*errorNumber) = VMX20_INITIALIZE_FAILURE;
+        return NULL;
+    }
+    (*errorNumber) = VMX20_NORMAL_TERMINATION;
 
-    if (!vm) (*errorNumber) = VMX20_INITIALIZE_FAILURE;
-    else (*errorNumber) = VMX20_NORMAL_TERMINATION;
+    vm->mem_words = memoryWords;
+    vm->flags = flags;
+    vm->fusions = VMX20_FUSE_ALL;
 
     return vm;
 }
 
 int32_t loadExecutableFile(void *handle, char *filename, int32_t *errorNumber)
 {
-    printf("LOAD EXE\n");
     VM* vm = (VM*) handle;
 
-    FILE* file;
-    file = fopen(filename, "r");
+    Image* img = image_open(filename, errorNumber);
+    if (!img)
+        return 0;
+
+    if (vm->image)
+        vm_detach_image(vm);
+    int ok = vm_attach_image(vm, img, errorNumber);
+    image_release(img);
+
+    return ok;
+}
+
+// read exactly len bytes at offset, exiting with message on failure
+static void read_exact(int fd, void* buf, size_t len, off_t offset, const char* message)
+{
+    if (pread(fd, buf, len, offset) != (ssize_t) len)
+    {
+        printf("ERROR: %s\n", message);
+        exit(1);
+    }
+}
+
+uint32_t image_hash(const char* name, uint32_t seed)
+{
+    // FNV-1a over the name, then a finalizer so that seeds spread well;
+    // must match the hash linkx20 builds the index with
+    uint32_t hash = 2166136261u ^ seed;
+    for (int i = 0; i < 16 && name[i]; i++)
+    {
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Read the metadata and symbol index of a version 2 file, whose trailer
+// ends the file past the code. Leaves a version 1 file alone; returns 0
+// for a trailer that doesn't fit the file.
+static int read_trailer(Image* img, int file_syms)
+{
+    off_t code_end = img->code_offset + sizeof(int32_t) * (off_t) img->hdr.code_size;
+    ExeTrailer trailer;
+    if (img->size < code_end + (off_t) sizeof(trailer) ||
+            pread(img->fd, &trailer, sizeof(trailer), img->size - sizeof(trailer)) !=
+                (ssize_t) sizeof(trailer) ||
+            trailer.magic != VMX20_EXE2_MAGIC)
+        return 1;
+
+    off_t seed_bytes = sizeof(uint32_t) * (off_t) trailer.index_buckets;
+    off_t slot_bytes = sizeof(int32_t) * (off_t) trailer.index_slots;
+    if (trailer.version != 2 || trailer.num_syms > (uint32_t) file_syms ||
+            trailer.index_buckets == 0 || trailer.index_slots == 0 ||
+            (trailer.index_slots & (trailer.index_slots - 1)) != 0 ||
+            trailer.index_offset < code_end ||
+            trailer.index_offset + seed_bytes + slot_bytes + (off_t) sizeof(trailer) > img->size ||
+            trailer.entry > (uint32_t) img->hdr.code_size)
+        return 0;
+
+    img->index_seeds = (uint32_t*) malloc(seed_bytes);
+    img->index_slots = (int32_t*) malloc(slot_bytes);
+    if (!img->index_seeds || !img->index_slots)
+    {
+        printf("ERROR: Could not allocate symbol index\n");
+        exit(1);
+    }
+    read_exact(img->fd, img->index_seeds, seed_bytes, trailer.index_offset,
+        "Could not read in symbol index");
+    read_exact(img->fd, img->index_slots, slot_bytes, trailer.index_offset + seed_bytes,
+        "Could not read in symbol index");
+    for (uint32_t i = 0; i < trailer.index_slots; i++)
+    {
+        if (img->index_slots[i] >= (int32_t) trailer.num_syms)
+            return 0;
+    }
+    img->index_buckets = trailer.index_buckets;
+    img->index_size = trailer.index_slots;
+
+    img->hdr.insym_size = trailer.num_syms * 5;
+    img->info.version = 2;
+    img->info.entry = trailer.entry;
+    if (trailer.memory_words > img->info.memoryWords)
+        img->info.memoryWords = trailer.memory_words;
+    img->info.stackWords = trailer.stack_words;
+    return 1;
+}
+
+// Index the insymbols of a version 1 file with open addressing on the
+// same hash, keeping the first of any names defined twice as the linear
+// search used to.
+static void index_syms(Image* img)
+{
+    int num_syms = img->hdr.insym_size / 5;
+    uint32_t size = 16;
+    while (size < (uint32_t) num_syms * 2)
+        size *= 2;
+    img->index_slots = (int32_t*) malloc(sizeof(int32_t) * size);
+    if (!img->index_slots)
+    {
+        printf("ERROR: Could not allocate symbol index\n");
+        exit(1);
+    }
+    memset(img->index_slots, 0xff, sizeof(int32_t) * size);
+    img->index_size = size;
+
+    for (int j = 0; j < num_syms; j++)
+    {
+        uint32_t slot = image_hash(img->syms[j].name, 0) & (size - 1);
+        while (img->index_slots[slot] >= 0 &&
+                strncmp(img->syms[img->index_slots[slot]].name, img->syms[j].name, 16) != 0)
+            slot = (slot + 1) & (size - 1);
+        if (img->index_slots[slot] < 0)
+            img->index_slots[slot] = j;
+    }
+}
+
+Sym* image_find_sym(Image* img, const char* label)
+{
+    // names are at most 16 characters, and longer labels hash like their prefix
+    if (strnlen(label, 17) > 16)
+        return NULL;
+
+    if (img->index_seeds)
+    {
+        uint32_t bucket = image_hash(label, 0) % img->index_buckets;
+        uint32_t slot = image_hash(label, img->index_seeds[bucket]) & (img->index_size - 1);
+        int32_t j = img->index_slots[slot];
+        if (j >= 0 && strncmp(img->syms[j].name, label, 16) == 0)
+            return &img->syms[j];
+        return NULL;
+    }
+
+    uint32_t slot = image_hash(label, 0) & (img->index_size - 1);
+    for (int32_t j; (j = img->index_slots[slot]) >= 0; slot = (slot + 1) & (img->index_size - 1))
+    {
+        if (strncmp(img->syms[j].name, label, 16) == 0)
+            return &img->syms[j];
+    }
+    return NULL;
+}
+
+Image* image_open(const char* filename, int32_t* errorNumber)
+{
+    int fd = open(filename, O_RDONLY);
     // ensure file opened properly
-    if (!file)
+    if (fd < 0)
     {
         (*errorNumber) = VMX20_FILE_NOT_FOUND;
-        return 0;
+        return NULL;
     }
 
     // check if file is a valid format
-    char* token = strtok(filename, ".");
-    token = strtok(NULL, ".");
-    if (strcmp(token, "exe") != 0)
+    const char* dot = strrchr(filename, '.');
+    if (!dot || strcmp(dot + 1, "exe") != 0)
     {
+        close(fd);
         (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
-        return 0;
+        return NULL;
     }
 
-    // read header section
-    if (fread(&vm->hdr, sizeof(Header), 1, file) != 1)
+    Image* img = (Image*) calloc(1, sizeof(Image));
+    if (!img)
     {
-        printf("ERROR: Failed to read header info\n");
+        printf("ERROR: Could not allocate image\n");
         exit(1);
     }
+    img->fd = fd;
+    img->path = strdup(filename);
+    atomic_init(&img->refs, 1);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        img->dev = st.st_dev;
+        img->ino = st.st_ino;
+        img->size = st.st_size;
+        img->mtime = st.st_mtim;
+    }
+
+    // read header section
+    read_exact(fd, &img->hdr, sizeof(Header), 0, "Failed to read header info");
 
     // check for outsymbols
-    if (vm->hdr.outsym_size != 0)
+    if (img->hdr.outsym_size != 0)
     {
+        image_release(img);
         (*errorNumber) = VMX20_FILE_CONTAINS_OUTSYMBOLS;
-        return 0;
+        return NULL;
     }
 
+    // a version 2 trailer names the real insymbols, ahead of the padding
+    int num_syms = img->hdr.insym_size / 5;
+    img->code_offset = sizeof(Header) + sizeof(Sym) * (long) num_syms;
+    img->info.version = 1;
+    img->info.memoryWords = img->hdr.code_size + 1;
+    if (!read_trailer(img, num_syms))
+    {
+        image_release(img);
+        (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
+        return NULL;
+    }
+    num_syms = img->hdr.insym_size / 5;
+
     // read insymbol section
-    vm->syms = (Sym*) malloc(sizeof(Sym) * vm->hdr.insym_size / 5);
-    if (!vm->syms) 
+    img->syms = (Sym*) malloc(sizeof(Sym) * (num_syms ? num_syms : 1));
+    if (!img->syms) 
     {
         printf("ERROR: Could not allocate symbol struct\n");
         exit(1);
     }
-    if (fread(vm->syms, sizeof(Sym), vm->hdr.insym_size / 5, file) != vm->hdr.insym_size / 5)
+    read_exact(fd, img->syms, sizeof(Sym) * num_syms, sizeof(Header), "Could not read in symbol info");
+    if (!img->index_seeds)
+        index_syms(img);
+
+    // pre-decode the code section, including the (zero) word just past its
+    // end, followed by an entry that ends execution when the pc runs off the end
+#ifndef VMX20_NO_THREADED
+    pthread_once(&threaded_once, init_threaded_handlers);
+#endif
+    int32_t code_size = img->hdr.code_size;
+    int32_t* code = (int32_t*) calloc(code_size + 1, sizeof(int32_t));
+    img->insns = (Insn*) malloc(sizeof(Insn) * (code_size + 2));
+    if (!code || !img->insns)
     {
-        printf("ERROR: Could not read in symbol info\n");
+        printf("ERROR: Could not allocate decoded code\n");
         exit(1);
     }
+    read_exact(fd, code, sizeof(int32_t) * code_size, img->code_offset, "Could not read in mem");
+    for (int i = 0; i <= code_size; i++)
+        decode_word(&img->insns[i], code[i], i);
+    img->insns[code_size + 1].op = OP_END;
+    img->insns[code_size + 1].handler = threaded_handlers ? threaded_handlers[OP_END] : NULL;
+    fuse_code(img->insns, code_size, VMX20_FUSE_ALL);
+    free(code);
 
-    // read mem section
-    vm->mem = (int32_t*) calloc(sizeof(int32_t), 10000000);
-    if (!vm->mem) 
+    return img;
+}
+
+void image_retain(Image* img)
+{
+    atomic_fetch_add(&img->refs, 1);
+}
+
+void image_release(Image* img)
+{
+    if (atomic_fetch_sub(&img->refs, 1) != 1)
+        return;
+
+    close(img->fd);
+    free(img->path);
+    free(img->syms);
+    free(img->index_seeds);
+    free(img->index_slots);
+    free(img->insns);
+    free(img);
+}
+
+// give vm memory holding img's code section
+static void attach_memory(VM* vm, Image* img)
+{
+    // map mem section, falling back to reading it into a calloc'd array
+    vm->map_base = NULL;
+    vm->map_len = 0;
+    vm->restored = 0;
+#ifndef VMX20_NO_MMAP
+    if (!map_memory(vm, img->fd, img->code_offset))
+#endif
     {
-        printf("ERROR: Could not allocate memory array\n");
-        exit(1);
+        vm->mem = (int32_t*) calloc(sizeof(int32_t), vm->mem_words);
+        if (!vm->mem) 
+        {
+            printf("ERROR: Could not allocate memory array\n");
+            exit(1);
+        }
+        if (vm->flags & VMX20_MEM_DENSE)
+            memset(vm->mem, 0, sizeof(int32_t) * vm->mem_words);
+        read_exact(img->fd, vm->mem, sizeof(int32_t) * vm->hdr.code_size, img->code_offset,
+            "Could not read in mem");
     }
-    if (fread(vm->mem, sizeof(int32_t), vm->hdr.code_size, file) != vm->hdr.code_size)
+}
+
+void vm_free_memory(VM* vm)
+{
+    if (vm->map_base)
+        munmap(vm->map_base, vm->map_len);
+    else
+        free(vm->mem);
+    vm->mem = NULL;
+    vm->map_base = NULL;
+    vm->map_len = 0;
+}
+
+int vm_attach_image(VM* vm, Image* img, int32_t* errorNumber)
+{
+    // at least the code and the word past its end must fit in the address space
+    if (img->info.memoryWords > vm->mem_words)
     {
-        printf("ERROR: Could not read in mem\n");
-        exit(1);
+        (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
+        return 0;
     }
 
-    fclose(file);
+    image_retain(img);
+    vm->image = img;
+    vm->hdr = img->hdr;
+    vm->syms = img->syms;
+    attach_memory(vm, img);
+
+    // each VM invalidates entries of its own copy of the decoded code
+    size_t insns_size = sizeof(Insn) * (vm->hdr.code_size + 2);
+    vm->insns = (Insn*) malloc(insns_size);
+    if (!vm->insns)
+    {
+        printf("ERROR: Could not allocate decoded code\n");
+        exit(1);
+    }
+    memcpy(vm->insns, img->insns, insns_size);
+    if (vm->fusions != VMX20_FUSE_ALL)
+        vm_refuse(vm);
+    memset(vm->pair_counts, 0, sizeof(vm->pair_counts));
 
     return 1;
 }
 
+void vm_detach_image(VM* vm)
+{
+    jit_destroy(vm);
+    profile_destroy(vm);
+    contention_destroy(vm);
+    vm_free_memory(vm);
+    free(vm->insns);
+    image_release(vm->image);
+
+    vm->insns = NULL;
+    vm->syms = NULL;
+    vm->image = NULL;
+}
+
+void vm_reset(VM* vm)
+{
+    Image* img = vm->image;
+    jit_destroy(vm);
+    profile_destroy(vm);
+    // memory restored from a snapshot would drop back to the snapshot
+    if (vm->restored)
+    {
+        vm_free_memory(vm);
+        attach_memory(vm, img);
+    }
+    // dropping private pages brings back the file contents of the code
+    // section and zeroes elsewhere; untouched pages cost nothing
+    else if (!vm->map_base || madvise(vm->map_base, vm->map_len, MADV_DONTNEED) != 0)
+    {
+        memset(vm->mem, 0, sizeof(int32_t) * vm->mem_words);
+        read_exact(img->fd, vm->mem, sizeof(int32_t) * vm->hdr.code_size, img->code_offset,
+            "Could not read in mem");
+    }
+    else
+        clear_past_code(vm);
+
+    memcpy(vm->insns, img->insns, sizeof(Insn) * (vm->hdr.code_size + 2));
+    if (vm->fusions != VMX20_FUSE_ALL)
+        vm_refuse(vm);
+}
+
 int32_t getAddress(void *handle, char *label, uint32_t *outAddr)
 {
-    printf("GET ADDR\n");
     VM* vm = (VM*) handle;
 
-    for (int i = 0; i < vm->hdr.insym_size / 5; i++)
+    Sym* sym = image_find_sym(vm->image, label);
+    if (!sym)
+        return 0;
+
+    (*outAddr) = sym->addr;
+    return 1;
+}
+
+int32_t getAddresses(void *handle, char *labels[], uint32_t numLabels, uint32_t outAddrs[])
+{
+    VM* vm = (VM*) handle;
+    int32_t found = 0;
+    for (uint32_t i = 0; i < numLabels; i++)
     {
-        // address found
-        if (strcmp(label, vm->syms[i].name) == 0)
-        {
-            (*outAddr) = vm->syms[i].addr;
-            return 1;
-        }
+        Sym* sym = image_find_sym(vm->image, labels[i]);
+        outAddrs[i] = sym ? (uint32_t) sym->addr : VMX20_NO_ADDRESS;
+        found += sym != NULL;
     }
+    return found;
+}
 
-    return 0;
+int32_t getExecutableInfo(void *handle, ExecutableInfo *out)
+{
+    VM* vm = (VM*) handle;
+    if (!vm->image)
+        return 0;
+
+    (*out) = vm->image->info;
+    return 1;
 }
 
 int32_t getWord(void *handle, uint32_t addr, int32_t *outWord)
 {
-    printf("GET WORD\n");
     VM* vm = (VM*) handle;
 
     if (addr >= vm->hdr.code_size)
@@ -145,346 +672,228 @@ int32_t getWord(void *handle, uint32_t addr, int32_t *outWord)
     return 1;
 }
 
+// Decode again the code words in a range that was written between runs,
+// and the fused instructions covering them, which are left unfused. With no
+// processor running the entries can be rewritten in place.
+static void invalidate_range(VM* vm, uint32_t addr, uint32_t count)
+{
+    uint32_t end = (uint32_t) vm->hdr.code_size + 1;
+    if (addr >= end)
+        return;
+    if (count < end - addr)
+        end = addr + count;
+    for (uint32_t a = addr; a < end; a++)
+        invalidate_word(vm, a);
+    for (uint32_t a = addr > 2 ? addr - 2 : 0; a < end; a++)
+    {
+        if (vm->insns[a].op == OP_STALE)
+            decode_word(&vm->insns[a], vm->mem[a], a);
+    }
+}
+
 int32_t putWord(void *handle, uint32_t addr, int32_t word)
 {
-    printf("PUT WORD\n");
     VM* vm = (VM*) handle;
 
     if (addr >= vm->hdr.code_size)
         return 0;
 
     vm->mem[addr] = word;
+    invalidate_range(vm, addr, 1);
 
     return 1;
 }
 
-int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
-      int terminationStatus[], int32_t trace)
+// whether count words from addr lie in the address space
+static int in_memory(VM* vm, uint32_t addr, uint32_t count)
+{
+    return vm->mem && addr <= vm->mem_words && count <= vm->mem_words - addr;
+}
+
+int32_t getWords(void *handle, uint32_t addr, uint32_t count, int32_t outWords[])
+{
+    VM* vm = (VM*) handle;
+    if (!in_memory(vm, addr, count))
+        return 0;
+
+    memcpy(outWords, &vm->mem[addr], sizeof(int32_t) * count);
+    return 1;
+}
+
+int32_t putWords(void *handle, uint32_t addr, uint32_t count, const int32_t words[])
+{
+    VM* vm = (VM*) handle;
+    if (!in_memory(vm, addr, count))
+        return 0;
+
+    memcpy(&vm->mem[addr], words, sizeof(int32_t) * count);
+    invalidate_range(vm, addr, count);
+    return 1;
+}
+
+int32_t fillWords(void *handle, uint32_t addr, uint32_t count, int32_t word)
 {
-    printf("EXE\n");
     VM* vm = (VM*) handle;
+    if (!in_memory(vm, addr, count))
+        return 0;
 
-    pthread_mutex_init(&vm->data_lock, NULL);
-    pthread_mutex_init(&vm->trace_lock, NULL);
+    if (word == 0)
+        memset(&vm->mem[addr], 0, sizeof(int32_t) * count);
+    else
+    {
+        for (uint32_t i = 0; i < count; i++)
+            vm->mem[addr + i] = word;
+    }
+    invalidate_range(vm, addr, count);
+    return 1;
+}
 
-    pthread_t threads[numProcessors];
-    ThreadArgs threadArgs[numProcessors];
-    for (int i = 0; i < numProcessors; i++) {
-        threadArgs[i].handle = vm;
-        threadArgs[i].initialSP = initialSP[i];
-        threadArgs[i].terminationStatus = &terminationStatus[i];
-        threadArgs[i].trace = trace;
-        threadArgs[i].pid = i;
-        threadArgs[i].pn = numProcessors;
+int32_t getMemoryView(void *handle, uint32_t addr, uint32_t count, int32_t flags, MemoryView *out)
+{
+    VM* vm = (VM*) handle;
+    if (!in_memory(vm, addr, count))
+        return 0;
+
+    out->address = addr;
+    out->count = count;
+    out->data = &vm->mem[addr];
+    out->words = (flags & VMX20_VIEW_WRITE) ? &vm->mem[addr] : NULL;
+    return 1;
+}
+
+void releaseMemoryView(void *handle, MemoryView *view)
+{
+    VM* vm = (VM*) handle;
+    // code written through the view is decoded again when it next runs
+    if (view->words && in_memory(vm, view->address, view->count))
+        invalidate_range(vm, view->address, view->count);
+    memset(view, 0, sizeof(*view));
+}
 
-        pthread_create(&threads[i], NULL, &execute_helper, &threadArgs[i]);
+int32_t execute(void *handle, uint32_t numProcessors, uint32_t initialSP[],
+      int terminationStatus[], int32_t trace)
+{
+    VM* vm = (VM*) handle;
+
+    Proc* procs = (Proc*) realloc(vm->procs, sizeof(Proc) * (numProcessors ? numProcessors : 1));
+    if (!procs)
+    {
+        printf("ERROR: Could not allocate processors\n");
+        exit(1);
     }
+    vm->procs = procs;
+    vm->num_procs = numProcessors;
 
     for (int i = 0; i < numProcessors; i++)
-        pthread_join(threads[i], NULL);
+    {
+        memset(procs[i].regs, 0, sizeof(procs[i].regs));
+        procs[i].regs[13] = 0;
+        procs[i].regs[14] = initialSP[i];
+        procs[i].regs[15] = vm->image->info.entry;
+        procs[i].pid = i;
+        procs[i].status = PROC_PREEMPTED;
+    }
 
-    for (int i = 0; i < numProcessors; i++)
+    return run_procs(vm, terminationStatus, trace);
+}
+
+// continue the processors stopped by their budget, and with past_halt
+// those that halted too; traps stay where they are
+static int32_t continue_procs(VM* vm, int terminationStatus[], int32_t trace, int past_halt)
+{
+    for (uint32_t i = 0; i < vm->num_procs; i++)
     {
-        if ((*threadArgs[i].terminationStatus) != VMX20_NORMAL_TERMINATION)
-            return 0;
+        int status = vm->procs[i].status;
+        if (status == VMX20_BUDGET_EXHAUSTED || (past_halt && status == VMX20_NORMAL_TERMINATION))
+            vm->procs[i].status = PROC_PREEMPTED;
     }
 
-    return 1;
+    return run_procs(vm, terminationStatus, trace);
 }
 
-void* execute_helper(void* args)
+int32_t resume(void *handle, int terminationStatus[], int32_t trace)
 {
-    printf("EXE HELP\n");
-    ThreadArgs* targs = (ThreadArgs*) args;
-    VM* vm = targs->handle;
+    return continue_procs((VM*) handle, terminationStatus, trace, 0);
+}
 
-    int32_t regs[16] = 
+int32_t resumePastHalt(void *handle, int terminationStatus[], int32_t trace)
+{
+    return continue_procs((VM*) handle, terminationStatus, trace, 1);
+}
+
+int32_t run_procs(VM* vm, int terminationStatus[], int32_t trace)
+{
+    Proc* procs = vm->procs;
+    uint32_t numProcessors = vm->num_procs;
+    vm->exec_flags = trace;
+    for (int i = 0; i < numProcessors; i++)
     {
-        0, 0, 0, 0, 0, 0, 0, 0,
-        0, 0, 0, 0, 0, 0, 0, 0
-    };
+        procs[i].budget = vm->budget && vm->budget < INT64_MAX ? (int64_t) vm->budget : INT64_MAX;
+        procs[i].prof = NULL;
+        procs[i].stats = NULL;
+    }
+
+    // traced and counted runs go through the interpreter, which sees every step
+    if ((trace & VMX20_EXEC_JIT) &&
+            ((trace & (VMX20_EXEC_TRACE | VMX20_EXEC_PAIRS | VMX20_EXEC_PROFILE |
+                VMX20_EXEC_CONTENTION)) || !jit_begin(vm)))
+        vm->exec_flags &= ~VMX20_EXEC_JIT;
 
-    regs[13] = 0;
-    regs[14] = targs->initialSP;
-    regs[15] = 0;
+    if (trace & VMX20_EXEC_PROFILE)
+        profile_begin(vm);
+    if (trace & VMX20_EXEC_CONTENTION)
+        contention_begin(vm);
 
-    while (regs[15] <= vm->hdr.code_size)
+    if (trace & VMX20_EXEC_PAIRS)
     {
-        regs[15]++;
-        if (targs->trace == 1) 
+        for (int i = 0; i < numProcessors; i++)
         {
-            pthread_mutex_lock(&vm->trace_lock);
-            char* buffer = (char*) calloc(200, sizeof(char));
-            char* buffer1 = (char*) calloc(150, sizeof(char));
-            sprintf(buffer1, "<%d> %08x %08x %08x %08x %08x %08x %08x %08x\n%08x %08x %08x %08x %08x %08x %08x %08x\n", targs->pid, regs[0], regs[1], regs[2], 
-            regs[3], regs[4], regs[5], regs[6], regs[7], regs[8], regs[9], regs[10], 
-            regs[11], regs[12], regs[13], regs[14], regs[15]);
-            int errNum = 0;
-            disassemble(vm, regs[15] - 1, buffer, &errNum);
-            strcat(buffer, buffer1);
-            printf("%s", buffer);
-            free(buffer);
-            pthread_mutex_unlock(&vm->trace_lock);
-        }
-        int op = vm->mem[regs[15] - 1] & 0xff;
-        int r1 = 0;
-        int r2 = 0;
-        float r1f = 0;
-        float r2f = 0;
-        float eqf = 0;
-        int addr = 0;
-        int cons = 0;
-        int offset = 0;
-        switch(op)
-        {
-            case 0:     // halt
-                (*targs->terminationStatus) = VMX20_NORMAL_TERMINATION;
-                return targs; 
-                break;
-            case 1:     // load
-                addr = (vm->mem[regs[15] - 1] & 0xfffff000) >> 12;
-                if (addr & (1 << 19))
-                    addr |= 0xfff00000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                pthread_mutex_lock(&vm->data_lock);
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = vm->mem[addr + regs[15]];
-                pthread_mutex_unlock(&vm->data_lock);
-                break;
-            case 2:     // store
-                addr = (vm->mem[regs[15] - 1] & 0xfffff000) >> 12;
-                if (addr & (1 << 19))
-                    addr |= 0xfff00000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                pthread_mutex_lock(&vm->data_lock);
-                vm->mem[addr + regs[15]] = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                pthread_mutex_unlock(&vm->data_lock);
-                break;
-            case 3:     // ldimm
-                cons = (vm->mem[regs[15] - 1] & 0xfffff000) >> 12;
-                if (cons & (1 << 19)) 
-                    cons |= 0xfff00000;
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = cons;
-                break;
-            case 4:     // ldaddr
-                addr = (vm->mem[regs[15] - 1] & 0xfffff000) >> 12;
-                if (addr & (1 << 19))
-                    addr |= 0xfff00000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = addr + regs[15];
-                break;
-            case 5:     // ldind
-                offset = (vm->mem[regs[15] - 1] & 0xffff0000) >> 16;
-                if (offset & (1 << 15))
-                    offset |= 0xffff0000;
-                // if (offset + regs[15] > vm->hdr.code_size)
-                // {
-                //     (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                //     return targs;
-                // }
-                pthread_mutex_lock(&vm->data_lock);
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = vm->mem[offset + regs[(vm->mem[regs[15] - 1] >> 12) & 0xf]];
-                pthread_mutex_unlock(&vm->data_lock);
-                break;
-            case 6:     // stind
-                offset = (vm->mem[regs[15] - 1] & 0xffff0000) >> 16;
-                if (offset & (1 << 15))
-                    offset |= 0xffff0000;
-                // if (offset + regs[15] > vm->hdr.code_size)
-                // {
-                //     (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                //     return targs;
-                // }
-                pthread_mutex_lock(&vm->data_lock);
-                vm->mem[offset + regs[(vm->mem[regs[15] - 1] >> 12) & 0xf]] = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                pthread_mutex_unlock(&vm->data_lock);
-                break;
-            case 7:     // addf
-                r1f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                eqf = r1f + r2f;
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = *(int32_t*) &eqf;
-                break;
-            case 8:     // subf
-                r1f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                eqf = r1f - r2f;
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = *(int32_t*) &eqf;
-                break;
-            case 9:     // divf
-                r1f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                if (r2 == 0)
-                {
-                    (*targs->terminationStatus) = VMX20_DIVIDE_BY_ZERO;
-                    return targs;
-                }
-                eqf = r1f / r2f;
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = *(int32_t*) &eqf;
-                break;
-            case 10:    // mulf
-                r1f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2f = *(float*) &regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                eqf = r1f * r2f;
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = *(int32_t*) &eqf;
-                break;
-            case 11:    // addi
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = r1 + r2;
-                break;
-            case 12:    // subi
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = r1 - r2;
-                break;
-            case 13:    // divi
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                if (r2 == 0)
-                {
-                    (*targs->terminationStatus) = VMX20_DIVIDE_BY_ZERO;
-                    return targs;
-                }
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = r1 / r2;
-                break;
-            case 14:    // muli
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = r1 * r2;
-                break;
-            case 15:    // call
-                regs[14]--;
-                vm->mem[regs[14]] = regs[15];
-                regs[14]--;
-                vm->mem[regs[14]] = regs[13];
-                regs[13] = regs[14];
-                regs[14]--;
-                vm->mem[regs[14] - 1] = 0;
-                addr = (vm->mem[regs[15] - 1] >> 12) & 0xfffff;
-                if (addr & (1 << 19))
-                    addr |= 0xfff00000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                regs[15] = addr + regs[15];
-                break;
-            case 16:    // ret
-                regs[13] = vm->mem[regs[14] + 1];
-                regs[14]++;
-                regs[15] = vm->mem[regs[14] + 1];
-                regs[14]++;
-                vm->mem[regs[13] - 1] = vm->mem[regs[14] - 2];
-                regs[14]++;
-                break;
-            case 17:    // blt
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                addr = (vm->mem[regs[15] - 1] >> 16) & 0xffff;
-                if (addr & (1 << 15))
-                    addr |= 0xffff0000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                if (r1 < r2)
-                    regs[15] = addr + regs[15];
-                break;
-            case 18:    // bgt
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                addr = (vm->mem[regs[15] - 1] >> 16) & 0xffff;
-                if (addr & (1 << 15))
-                    addr |= 0xffff0000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                if (r1 > r2)
-                    regs[15] = addr + regs[15];
-                break;
-            case 19:    // beq
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                addr = (vm->mem[regs[15] - 1] >> 16) & 0xffff;
-                if (addr & (1 << 15))
-                    addr |= 0xffff0000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                if (r1 == r2)
-                    regs[15] = addr + regs[15];
-                break;
-            case 20:    // jmp
-                addr = (vm->mem[regs[15] - 1] >> 12) & 0xfffff;
-                if (addr << 19 == 1)
-                    addr |= 0xfff00000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                regs[15] = addr + regs[15];
-                break;
-            case 21:    // cmpxchg
-                r1 = regs[(vm->mem[regs[15] - 1] >> 8) & 0xf];
-                r2 = regs[(vm->mem[regs[15] - 1] >> 12) & 0xf];
-                addr = (vm->mem[regs[15] - 1] >> 16) & 0xffff;
-                if (addr & (1 << 15))
-                    addr |= 0xffff0000;
-                if (addr + regs[15] > vm->hdr.code_size)
-                {
-                    (*targs->terminationStatus) = VMX20_ADDRESS_OUT_OF_RANGE;
-                    return targs;
-                }
-                pthread_mutex_lock(&vm->data_lock);
-                if (r1 == vm->mem[addr + regs[15]])
-                    vm->mem[addr + regs[15]] = r2;
-                else 
-                    regs[(vm->mem[regs[15] - 1] >> 8) & 0xf] = vm->mem[addr + regs[15]];
-                pthread_mutex_unlock(&vm->data_lock);
-                break;
-            case 22:    // getpid
-                regs[vm->mem[regs[15] - 1] >> 8 & 0xfffff] = targs->pid;
-                break;
-            case 23:    // getpn
-                regs[vm->mem[regs[15] - 1] >> 8 & 0xfffff] = targs->pn;
-                break;
-            case 24:    // push
-                regs[14]--;
-                vm->mem[regs[14]] = regs[vm->mem[regs[15] - 1] >> 8 & 0xf];
-                
-                break; 
-            case 25:    // pop
-                regs[vm->mem[regs[15] - 1] >> 8 & 0xf] = vm->mem[regs[14]];
-                regs[14]++;
-                break;
-            default: 
-                (*targs->terminationStatus) = VMX20_ILLEGAL_INSTRUCTION;
-                return targs;
-                break;
+            procs[i].last_op = -1;
+            memset(procs[i].pairs, 0, sizeof(procs[i].pairs));
         }
     }
 
-    (*targs->terminationStatus) = VMX20_NORMAL_TERMINATION;
-    return targs;
+    if (trace & VMX20_EXEC_TRACE)
+        trace_begin(vm);
+    workers_run(vm);
+    if (trace & VMX20_EXEC_TRACE)
+        trace_end(vm);
+
+    if (trace & VMX20_EXEC_PAIRS)
+    {
+        for (int i = 0; i < numProcessors; i++)
+            for (int a = 0; a < VMX20_NUM_OPCODES; a++)
+                for (int b = 0; b < VMX20_NUM_OPCODES; b++)
+                    vm->pair_counts[a][b] += procs[i].pairs[a][b];
+    }
+
+    int ok = 1;
+    for (int i = 0; i < numProcessors; i++)
+    {
+        terminationStatus[i] = procs[i].status;
+        if (terminationStatus[i] != VMX20_NORMAL_TERMINATION)
+            ok = 0;
+    }
+
+    return ok;
+}
+
+int execute_helper(VM* vm, Proc* p, int64_t budget)
+{
+    if (vm->exec_flags & VMX20_EXEC_JIT)
+        return jit_run(vm, p, budget);
+    return interp_run(vm, p, budget);
+}
+
+int interp_run(VM* vm, Proc* p, int64_t budget)
+{
+    if (vm->exec_flags & (VMX20_EXEC_PROFILE | VMX20_EXEC_CONTENTION))
+        return run_instrumented(vm, p, budget);
+#ifndef VMX20_NO_THREADED
+    if (!(vm->exec_flags & VMX20_EXEC_SWITCH_DISPATCH))
+        return run_threaded(vm, p, budget);
+#endif
+    return run_switch(vm, p, budget);
 }
 
 int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumber)
@@ -495,7 +904,12 @@ int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumb
     //     (*errorNumber) = VMX20_ADDRESS_OUT_OF_RANGE;
     //     return 0;
     // }
-    int op = vm->mem[address] & 0xff;
+    return disassembleWord(vm->mem[address], buffer, errorNumber);
+}
+
+int disassembleWord(int32_t word, char *buffer, int32_t *errorNumber)
+{
+    int op = word & 0xff;
     int addr = 0;
     int cons = 0;
     int offset = 0;
@@ -507,152 +921,152 @@ int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumb
     {
         case 0:     // halt
             (*errorNumber) = VMX20_NORMAL_TERMINATION;
-            buffer = "halt";
+            sprintf(buffer, "halt\n");
             return 1; 
             break;
         case 1:     // load
-            addr = (vm->mem[address] & 0xfffff000) >> 12;
+            addr = (word & 0xfffff000) >> 12;
             if (addr & (1 << 19))
                 addr |= 0xfff00000;
-            r1 = (vm->mem[address] >> 8) & 0xf;
+            r1 = (word >> 8) & 0xf;
             sprintf(buffer, "load r%d, %d\n", r1, addr);
             break;
         case 2:     // store
-            addr = (vm->mem[address] & 0xfffff000) >> 12;
+            addr = (word & 0xfffff000) >> 12;
             if (addr & (1 << 19))
                 addr |= 0xfff00000;
-            r1 = (vm->mem[address] >> 8) & 0xf;
+            r1 = (word >> 8) & 0xf;
             sprintf(buffer, "store r%d, %d\n", r1, addr);
             break;
         case 3:     // ldimm
-            cons = (vm->mem[address] & 0xfffff000) >> 12;
-            r1 = (vm->mem[address] >> 8) & 0xf;
+            cons = (word & 0xfffff000) >> 12;
+            r1 = (word >> 8) & 0xf;
             sprintf(buffer, "ldimm r%d, %d\n", r1, cons);
             break;
         case 4:     // ldaddr
-            addr = (vm->mem[address] & 0xfffff000) >> 12;
+            addr = (word & 0xfffff000) >> 12;
             if (addr & (1 << 19))
                 addr |= 0xfff00000;
-            r1 = (vm->mem[address] >> 8) & 0xf;
+            r1 = (word >> 8) & 0xf;
             sprintf(buffer, "ldaddr r%d, %d\n", r1, addr);
             break;
         case 5:     // ldind
-            offset = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            offset = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (offset & (1 << 15))
                 offset |= 0xffff0000;
             sprintf(buffer, "ldind r%d, %d(r%d)\n", r1, offset, r2);
             break;
         case 6:     // stind
-            offset = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            offset = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (offset & (1 << 15))
                 offset |= 0xffff0000;
             sprintf(buffer, "stind r%d, %d(r%d)\n", r1, offset, r2);
             break;
         case 7:     // addf
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "addf r%d, r%d\n", r1, r2);
             break;
         case 8:     // subf
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "subf r%d, r%d\n", r1, r2);
             break;
         case 9:     // divf
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "divf r%d, r%d\n", r1, r2);
             break;
         case 10:    // mulf
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "mulf r%d, r%d\n", r1, r2);
             break;
         case 11:    // addi
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "addi r%d, r%d\n", r1, r2);
             break;
         case 12:    // subi
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "subi r%d, r%d\n", r1, r2);
             break;
         case 13:    // divi
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "divi r%d, r%d\n", r1, r2);
             break;
         case 14:    // muli
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             sprintf(buffer, "muli r%d, r%d\n", r1, r2);
             break;
         case 15:    // call
-            addr = (vm->mem[address] & 0xfffff000) >> 12;
+            addr = (word & 0xfffff000) >> 12;
             if (addr & (1 << 19))
                 addr |= 0xfff00000;
             sprintf(buffer, "call %d\n", addr);
             break;
         case 16:    // ret
-            buffer = "ret";
+            sprintf(buffer, "ret\n");
             break;
         case 17:    // blt
-            addr = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            addr = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (addr & (1 << 15))
                 addr |= 0xffff0000;
             sprintf(buffer, "blt r%d, r%d, %d\n", r1, r2, addr);
             break;
         case 18:    // bgt
-            addr = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            addr = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (addr & (1 << 15))
                 addr |= 0xffff0000;
             sprintf(buffer, "bgt r%d, r%d, %d\n", r1, r2, addr);
             break;
         case 19:    // beq
-            addr = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            addr = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (addr & (1 << 15))
                 addr |= 0xffff0000;
             sprintf(buffer, "beq r%d, r%d, %d\n", r1, r2, addr);
             break;
         case 20:    // jmp
-            addr = (vm->mem[address] & 0xfffff000) >> 12;
+            addr = (word & 0xfffff000) >> 12;
             if (addr & (1 << 19))
                 addr |= 0xfff00000;
             sprintf(buffer, "jmp %d\n", addr);
             break;
         case 21:    // cmpxchg
-            addr = (vm->mem[address] & 0xffff0000) >> 16;
-            r1 = (vm->mem[address] >> 8) & 0xf;
-            r2 = (vm->mem[address] >> 12) & 0xf;
+            addr = (word & 0xffff0000) >> 16;
+            r1 = (word >> 8) & 0xf;
+            r2 = (word >> 12) & 0xf;
             if (addr & (1 << 15))
                 addr |= 0xffff0000;
             sprintf(buffer, "cmpxchg r%d, r%d, %d\n", r1, r2, addr);
             break;
         case 22:    // getpid
-            r1 = vm->mem[address] >> 12 & 0xfffff;
+            r1 = word >> 12 & 0xfffff;
             sprintf(buffer, "getpid r%d\n", r1);
             break;
         case 23:    // getpn
-            r1 = vm->mem[address] >> 12 & 0xfffff;
+            r1 = word >> 12 & 0xfffff;
             sprintf(buffer, "getpn r%d\n", r1);
             break;
         case 24:    // push
-            r1 = vm->mem[address] >> 8 & 0xf;
+            r1 = word >> 8 & 0xf;
             sprintf(buffer, "push r%d\n", r1);
             break; 
         case 25:    // pop
-            r1 = vm->mem[address] >> 8 & 0xf;
+            r1 = word >> 8 & 0xf;
             sprintf(buffer, "pop r%d\n", r1);
             break;
         default: 
@@ -664,12 +1078,38 @@ int disassemble(void *handle, uint32_t address, char *buffer, int32_t *errorNumb
     return 1;
 }
 
+int32_t getResidentBytes(void *handle, uint64_t *outBytes)
+{
+    VM* vm = (VM*) handle;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // count the pages of the address space that are actually committed
+    uintptr_t start = (uintptr_t) vm->mem / page * page;
+    uintptr_t end = (uintptr_t) (vm->mem + vm->mem_words);
+    size_t pages = (end - start + page - 1) / page;
+    unsigned char* vec = (unsigned char*) malloc(pages);
+    if (!vec || mincore((void*) start, end - start, vec) != 0)
+    {
+        free(vec);
+        return 0;
+    }
+
+    uint64_t resident = 0;
+    for (size_t i = 0; i < pages; i++)
+        resident += vec[i] & 1;
+    free(vec);
+
+    (*outBytes) = resident * page;
+    return 1;
+}
+
 void cleanup(void *handle)
 {
     VM* vm = (VM*) handle;
-    free(vm->syms);
-    free(vm->mem);
-    pthread_mutex_destroy(&vm->data_lock);
-    pthread_mutex_destroy(&vm->trace_lock);
+    workers_destroy(vm);
+    trace_destroy(vm);
+    if (vm->image)
+        vm_detach_image(vm);
+    free(vm->procs);
     free(vm);
 }
@@ -0,0 +1,255 @@
+#ifndef VMX20EXT_H
+#define VMX20EXT_H
+
+// Extensions to the vmx20 library interface declared in vmx20.h.
+
+#include <stdint.h>
+
+// flag bits accepted in the trace argument of execute
+#define VMX20_EXEC_TRACE            0x1     // trace every instruction (the original trace == 1)
+#define VMX20_EXEC_SWITCH_DISPATCH  0x2     // use the switch interpreter instead of threaded code
+#define VMX20_EXEC_JIT              0x4     // compile hot code to native code where supported
+#define VMX20_EXEC_PAIRS            0x8     // count adjacent opcode pairs, for tuneFusions
+#define VMX20_EXEC_PROFILE          0x10    // collect the execution profile (see getOpcodeCounts)
+#define VMX20_EXEC_CONTENTION       0x20    // collect contention counts (see executeWithStats)
+
+// number of opcodes of the instruction set, halt (0) through pop (25)
+#define VMX20_NUM_OPCODES           26
+
+// superinstruction kinds accepted by setFusions
+#define VMX20_FUSE_LDIMM_ADDI       0x1     // ldimm rA, k; addi rB, rA
+#define VMX20_FUSE_LOAD_ADDI_STORE  0x2     // load rA, x; addi rA, rB; store rA, x
+#define VMX20_FUSE_PUSH_CALL        0x4     // push rA; call f
+#define VMX20_FUSE_POP_POP          0x8     // pop rA; pop rB
+#define VMX20_FUSE_ADDI_BLT         0x10    // addi rA, rB; blt rA, rC, t
+#define VMX20_FUSE_ALL              0x1f
+
+// address space of a VM created by initVm
+#define VMX20_DEFAULT_MEMORY_WORDS  10000000
+
+// flag bits accepted by initVmSized
+#define VMX20_MEM_DENSE             0x1     // commit the whole address space up front
+
+// flag bits accepted by setWorkerThreads
+#define VMX20_WORKERS_PIN           0x1     // pin each worker thread to its own core
+
+// termination status of a processor stopped by setInstructionBudget; resume
+// continues it
+#define VMX20_BUDGET_EXHAUSTED      8
+
+// first word of a trace file, followed by TraceRecords
+#define VMX20_TRACE_MAGIC           0x43525458  // "XTRC"
+
+// One traced step: the instruction about to run and the registers at
+// that point, with regs[15] already pointing past it.
+typedef struct {
+    int32_t pid;
+    uint32_t pc;
+    int32_t word;
+    int32_t regs[16];
+} TraceRecord;
+
+// Create a VM with an address space of memoryWords words. By default the
+// memory is sparse: only pages that are written are ever committed.
+void *initVmSized(uint32_t memoryWords, int32_t flags, int32_t *errorNumber);
+
+// Report how many bytes of the VM's address space are resident.
+int32_t getResidentBytes(void *handle, uint64_t *outBytes);
+
+// Choose how many OS threads run the simulated processors of the VM.
+// The threads are kept between execute calls. 0 (the default) gives one
+// thread per processor; fewer threads than processors time-slice them.
+int32_t setWorkerThreads(void *handle, uint32_t numThreads, int32_t flags);
+
+// Let each processor run at most instructions instructions per execute or
+// resume call, 0 (the default) for no limit. A processor that reaches the
+// limit stops with VMX20_BUDGET_EXHAUSTED and resume carries it on.
+int32_t setInstructionBudget(void *handle, uint64_t instructions);
+
+// Write the binary trace of execute calls with VMX20_EXEC_TRACE set to
+// filename instead of vmx20.trace. Use tracefmt to turn it into text.
+int32_t setTraceFile(void *handle, char *filename);
+
+// Disassemble one code word into buffer, like disassemble does for an
+// address in a VM.
+int disassembleWord(int32_t word, char *buffer, int32_t *errorNumber);
+
+// Choose which superinstructions the VM's decoded code uses; loading an
+// executable applies all of them. Memory seen by getWord and disassemble
+// is unaffected.
+int32_t setFusions(void *handle, int32_t mask);
+
+// Copy out the opcode pair counts of every VMX20_EXEC_PAIRS run since the
+// executable was loaded, counts[previous][next].
+int32_t getOpcodePairs(void *handle, uint64_t counts[VMX20_NUM_OPCODES][VMX20_NUM_OPCODES]);
+
+// Enable only the superinstructions whose opcode pairs were seen at least
+// minCount times in the VMX20_EXEC_PAIRS runs so far. Returns the kinds chosen.
+int32_t tuneFusions(void *handle, uint64_t minCount);
+
+// Counts of one code address in the VMX20_EXEC_PROFILE runs of a processor.
+typedef struct {
+    uint64_t hits;          // times the instruction ran
+    uint64_t taken;         // blt/bgt/beq: times the branch was taken
+    uint64_t notTaken;
+    uint64_t calls;         // times the address was called
+} AddressProfile;
+
+// Profiled instructions run by processor pid, per opcode.
+int32_t getOpcodeCounts(void *handle, uint32_t pid, uint64_t counts[VMX20_NUM_OPCODES]);
+
+// Profile counts of one code address for processor pid.
+int32_t getAddressProfile(void *handle, uint32_t pid, uint32_t address, AddressProfile *out);
+
+// Name address after the closest insymbol at or below it, as "name" or
+// "name+offset".
+int32_t symbolize(void *handle, uint32_t address, char *buffer, int32_t size);
+
+// Write a symbolized text report of the profile: opcode counts, then every
+// address that ran with its hit, branch and call counts.
+int32_t writeProfile(void *handle, char *filename);
+
+// Write instruction counts per call stack in the collapsed-stack format
+// read by flame graph tools, one "p<pid>;frame;frame count" line each.
+int32_t writeCollapsedStacks(void *handle, char *filename);
+
+// Throw away the profile collected so far.
+void resetProfile(void *handle);
+
+// words of vm->mem sharing a 64-byte host cache line
+#define VMX20_CACHE_LINE_WORDS  16
+
+// entries of each list in SharingStats
+#define VMX20_STATS_HOT         16
+
+// What one processor did during executeWithStats.
+typedef struct {
+    uint64_t instructions;
+    uint64_t lockWaitNs;        // acquiring the run queue lock after its time slices
+    uint64_t queueWaitNs;       // runnable but waiting for a worker thread
+    uint64_t cmpxchgSuccess;
+    uint64_t cmpxchgFailure;
+} ProcStats;
+
+// Accesses to a data word, or to the words of one cache line, by all
+// processors. Stack traffic from push, pop, call and ret isn't counted.
+typedef struct {
+    uint32_t address;           // the word, or the line's first word in VM memory
+    uint32_t processors;        // processors that touched it
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t cmpxchgSuccess;
+    uint64_t cmpxchgFailure;
+    uint32_t sharedWords;       // lines: words touched by more than one processor
+} SharedStats;
+
+// Memory shared between processors during executeWithStats.
+typedef struct {
+    // words written and touched by several processors, most accessed first
+    uint32_t numHotWords;
+    SharedStats hotWords[VMX20_STATS_HOT];
+    // host cache lines written and touched by several processors, most
+    // accessed first; lines with sharedWords == 0 are pure false sharing.
+    // Lines follow the host addresses of the words, so they need not start
+    // at a multiple of VMX20_CACHE_LINE_WORDS.
+    uint32_t numHotLines;
+    SharedStats hotLines[VMX20_STATS_HOT];
+} SharingStats;
+
+// execute, also filling procStats (one per processor, like
+// terminationStatus) and sharing. Runs are interpreted while counting.
+int32_t executeWithStats(void *handle, uint32_t numProcessors, uint32_t initialSP[],
+    int terminationStatus[], int32_t trace, ProcStats procStats[], SharingStats *sharing);
+
+// Accesses to one word by all processors during the last executeWithStats.
+int32_t getAddressContention(void *handle, uint32_t address, SharedStats *out);
+
+// outAddrs entry of a label getAddresses didn't find
+#define VMX20_NO_ADDRESS            0xffffffffu
+
+// Look up numLabels labels at once, like getAddress does one. Returns how
+// many were found; the others get VMX20_NO_ADDRESS.
+int32_t getAddresses(void *handle, char *labels[], uint32_t numLabels, uint32_t outAddrs[]);
+
+// Copy count words between VM memory at addr and the host, or set count
+// words to word. Unlike getWord and putWord these reach the whole address
+// space, not just the code; they fail if the range doesn't fit in it.
+int32_t getWords(void *handle, uint32_t addr, uint32_t count, int32_t outWords[]);
+int32_t putWords(void *handle, uint32_t addr, uint32_t count, const int32_t words[]);
+int32_t fillWords(void *handle, uint32_t addr, uint32_t count, int32_t word);
+
+// flag bits accepted by getMemoryView
+#define VMX20_VIEW_WRITE            0x1     // the host writes through the view
+
+// count words of VM memory from address, shared with the host without copying
+typedef struct {
+    uint32_t address;
+    uint32_t count;
+    const int32_t *data;
+    int32_t *words;             // the same words when writable, NULL otherwise
+} MemoryView;
+
+// Get a view of count words at addr. It stays valid until the executable
+// is replaced or the VM cleaned up; execute may change what it shows. Give
+// a writable view back with releaseMemoryView before the next execute, so
+// code written through it is decoded again.
+int32_t getMemoryView(void *handle, uint32_t addr, uint32_t count, int32_t flags, MemoryView *out);
+void releaseMemoryView(void *handle, MemoryView *view);
+
+// What the loaded executable says about itself. Version 1 files start at
+// address 0 and need room for their code plus one word, with no stack size.
+typedef struct {
+    uint32_t version;       // 1, or 2 for files linked with linkx20 -2
+    uint32_t entry;         // address the processors start at
+    uint32_t memoryWords;   // smallest address space the program runs in
+    uint32_t stackWords;    // stack each processor needs, 0 if not given
+} ExecutableInfo;
+
+int32_t getExecutableInfo(void *handle, ExecutableInfo *out);
+
+// Continue the processors of the last execute call, or of a restored
+// snapshot, that stopped with VMX20_BUDGET_EXHAUSTED, from their next
+// instruction. Processors that halted or trapped keep their status.
+int32_t resume(void *handle, int terminationStatus[], int32_t trace);
+
+// Like resume, but processors that halted also go on, with the instruction
+// after their halt. A program can halt once it is set up, be snapshotted
+// there, and have every VM restored from the snapshot carry on from it.
+int32_t resumePastHalt(void *handle, int terminationStatus[], int32_t trace);
+
+// Capture the VM's memory and the registers of the processors of its last
+// execute call. NULL if no executable is loaded.
+void *snapshot(void *handle);
+
+// Give the VM the executable, memory and processors of snap. The memory is
+// shared copy-on-write, so restoring costs little however large it is.
+// Fails for a VM whose memory size differs from snap's. Follow with resume
+// or resumePastHalt to carry on, or with execute to start over on the
+// restored memory.
+int32_t restore(void *handle, void *snap);
+
+// Write snap to filename and read it back. The file refers to the
+// executable by path, which must still hold the same file when it is read;
+// its memory is mapped, not read, by restore.
+int32_t saveSnapshot(void *snap, char *filename);
+void *loadSnapshot(char *filename, int32_t *errorNumber);
+
+// Free a snapshot. VMs restored from it keep their memory.
+void destroySnapshot(void *snap);
+
+// Create a pool of numVms idle VMs for running many executables in a row.
+// VMs acquired from the pool have the given memory size and flags.
+void *createVmPool(uint32_t numVms, uint32_t memoryWords, int32_t flags, int32_t *errorNumber);
+
+// Get a VM from the pool with filename loaded, ready to execute. Parsed
+// executables are cached by path, and a VM that already ran the same
+// executable is reset by discarding only the pages it dirtied.
+void *acquireVm(void *pool, char *filename, int32_t *errorNumber);
+
+// Hand a VM back to the pool, keeping its memory for the next run.
+void releaseVm(void *pool, void *handle);
+
+// Clean up every idle VM and cached executable of the pool.
+void destroyVmPool(void *pool);
+
+#endif
@@ -0,0 +1,114 @@
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <string.h>
+
+// Peephole pass over decoded code. Fused entries are only built where the
+// sequence can't trap (targets are checked here) and doesn't name r15,
+// whose value the words of a sequence would otherwise see differently.
+
+// opcode pairs that make a fusion worth having, for tuneFusions
+static const struct {
+    int32_t fusion;
+    int first;
+    int second;
+} fusion_pairs[] = {
+    { VMX20_FUSE_LDIMM_ADDI, 3, 11 },
+    { VMX20_FUSE_LOAD_ADDI_STORE, 1, 11 },
+    { VMX20_FUSE_LOAD_ADDI_STORE, 11, 2 },
+    { VMX20_FUSE_PUSH_CALL, 24, 15 },
+    { VMX20_FUSE_POP_POP, 25, 25 },
+    { VMX20_FUSE_ADDI_BLT, 11, 17 },
+};
+
+void fuse_code(Insn* insns, uint32_t code_size, int32_t mask)
+{
+    // each entry is built from the plain entries after it, which are only
+    // overwritten once the scan moves on to them
+    for (uint32_t i = 0; i + 1 <= code_size; i++)
+    {
+        Insn* a = &insns[i];
+        Insn* b = &insns[i + 1];
+        Insn* c = i + 2 <= code_size ? &insns[i + 2] : NULL;
+        Insn fused = *a;
+
+        if ((mask & VMX20_FUSE_LOAD_ADDI_STORE) && c && a->op == 1 && b->op == 11 && c->op == 2 &&
+            b->r1 == a->r1 && c->r1 == a->r1 && c->imm == a->imm && a->r1 != 15 && b->r2 != 15 &&
+            (uint32_t) a->imm <= code_size)
+        {
+            fused.op = OP_LOAD_ADDI_STORE;
+            fused.r2 = b->r2;
+        }
+        else if ((mask & VMX20_FUSE_LDIMM_ADDI) && a->op == 3 && b->op == 11 && b->r2 == a->r1 &&
+            a->r1 != 15 && b->r1 != 15)
+        {
+            fused.op = OP_LDIMM_ADDI;
+            fused.r2 = b->r1;
+        }
+        else if ((mask & VMX20_FUSE_PUSH_CALL) && a->op == 24 && b->op == 15 &&
+            (uint32_t) b->imm <= code_size)
+        {
+            fused.op = OP_PUSH_CALL;
+            fused.imm = b->imm;
+        }
+        else if ((mask & VMX20_FUSE_POP_POP) && a->op == 25 && b->op == 25 &&
+            a->r1 != 14 && a->r1 != 15 && b->r1 != 15)
+        {
+            // popping into sp first would move the second pop
+            fused.op = OP_POP_POP;
+            fused.r2 = b->r1;
+        }
+        else if ((mask & VMX20_FUSE_ADDI_BLT) && a->op == 11 && b->op == 17 && b->r1 == a->r1 &&
+            a->r1 != 15 && a->r2 != 15 && b->r2 != 15 && (uint32_t) b->imm <= code_size)
+        {
+            fused.op = OP_ADDI_BLT;
+            fused.rx = b->r2;
+            fused.imm = b->imm;
+        }
+        else
+            continue;
+
+        fused.handler = threaded_handlers ? threaded_handlers[fused.op] : NULL;
+        *a = fused;
+    }
+}
+
+void vm_refuse(VM* vm)
+{
+    uint32_t code_size = vm->hdr.code_size;
+    for (uint32_t i = 0; i <= code_size; i++)
+        decode_word(&vm->insns[i], vm->mem[i], i);
+    fuse_code(vm->insns, code_size, vm->fusions);
+}
+
+int32_t setFusions(void *handle, int32_t mask)
+{
+    VM* vm = (VM*) handle;
+    vm->fusions = mask & VMX20_FUSE_ALL;
+    if (vm->insns)
+        vm_refuse(vm);
+    return 1;
+}
+
+int32_t getOpcodePairs(void *handle, uint64_t counts[VMX20_NUM_OPCODES][VMX20_NUM_OPCODES])
+{
+    VM* vm = (VM*) handle;
+    memcpy(counts, vm->pair_counts, sizeof(vm->pair_counts));
+    return 1;
+}
+
+int32_t tuneFusions(void *handle, uint64_t minCount)
+{
+    VM* vm = (VM*) handle;
+    int32_t mask = VMX20_FUSE_ALL;
+    int num_pairs = sizeof(fusion_pairs) / sizeof(fusion_pairs[0]);
+    for (int i = 0; i < num_pairs; i++)
+    {
+        if (vm->pair_counts[fusion_pairs[i].first][fusion_pairs[i].second] < minCount)
+            mask &= ~fusion_pairs[i].fusion;
+    }
+
+    setFusions(vm, mask);
+    return mask;
+}
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#if defined(__x86_64__) && !defined(VMX20_NO_JIT)
+
+#include <sys/mman.h>
+
+// Baseline JIT. Straight-line runs of register, float, load and indexed
+// store instructions ending in a branch are translated into x86-64, one
+// basic block at a time. The register file stays in the Proc (rdi points
+// at it, rsi at mem) and every block returns to jit_run, except a branch
+// back to its own start, which loops natively. Anything a block can't do
+// itself (traps, stores into the code region, calls, the rest of the
+// instruction set) is left to the interpreter one instruction at a time.
+
+// executable code per processor; when it fills up every block is dropped
+#define CODE_BYTES (1 << 20)
+
+// instructions per block, and the code bytes reserved for each of them
+#define MAX_BLOCK 256
+#define BYTES_PER_INSN 96
+
+// entry of a pc that doesn't start a compilable block
+#define NO_BLOCK ((void*) 1)
+
+// host registers as encoded in ModRM
+#define EAX 0
+#define ECX 1
+
+typedef int64_t (*JitBlock)(int32_t* regs, int32_t* mem, int64_t budget);
+
+// compiled blocks of one processor, only ever used by the thread running it
+typedef struct {
+    uint8_t* code;
+    size_t used;
+    void** entry;       // block starting at each pc, NULL until compiled
+    unsigned int epoch; // vm->jit_epoch the blocks were compiled under
+} JitProc;
+
+struct Jit {
+    JitProc* procs;
+    uint32_t num_procs;
+};
+
+// a conditional jump to a side exit, patched once the exits are placed
+typedef struct {
+    uint8_t* patch;
+    int32_t pc;         // pc to resume at in the interpreter
+    int32_t undone;     // instructions charged to the budget but not run
+} Exit;
+
+typedef struct {
+    uint8_t* p;
+    Exit exits[MAX_BLOCK * 3];
+    int num_exits;
+} Emit;
+
+static void emit1(Emit* e, uint8_t b)
+{
+    *e->p++ = b;
+}
+
+static void emit4(Emit* e, int32_t v)
+{
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+
+// mov host, [rdi + 4*r] / mov [rdi + 4*r], host
+static void emit_get(Emit* e, int host, int r)
+{
+    emit1(e, 0x8b); emit1(e, 0x47 | host << 3); emit1(e, 4 * r);
+}
+
+static void emit_put(Emit* e, int host, int r)
+{
+    emit1(e, 0x89); emit1(e, 0x47 | host << 3); emit1(e, 4 * r);
+}
+
+// movss xmm, [rdi + 4*r] / movss [rdi + 4*r], xmm
+static void emit_getf(Emit* e, int xmm, int r)
+{
+    emit1(e, 0xf3); emit1(e, 0x0f); emit1(e, 0x10); emit1(e, 0x47 | xmm << 3); emit1(e, 4 * r);
+}
+
+static void emit_putf(Emit* e, int xmm, int r)
+{
+    emit1(e, 0xf3); emit1(e, 0x0f); emit1(e, 0x11); emit1(e, 0x47 | xmm << 3); emit1(e, 4 * r);
+}
+
+// mov dword [rdi + 4*r], imm
+static void emit_set(Emit* e, int r, int32_t imm)
+{
+    emit1(e, 0xc7); emit1(e, 0x47); emit1(e, 4 * r); emit4(e, imm);
+}
+
+// jcc rel32 to a side exit that resumes at pc
+static void emit_exit_jcc(Emit* e, uint8_t cc, int32_t pc, int32_t undone)
+{
+    emit1(e, 0x0f); emit1(e, cc);
+    Exit* x = &e->exits[e->num_exits++];
+    x->patch = e->p;
+    x->pc = pc;
+    x->undone = undone;
+    emit4(e, 0);
+}
+
+// store the next pc and return the remaining budget (held in r8)
+static void emit_return(Emit* e, int32_t pc)
+{
+    emit_set(e, 15, pc);
+    emit1(e, 0x4c); emit1(e, 0x89); emit1(e, 0xc0);   // mov rax, r8
+    emit1(e, 0xc3);                                     // ret
+}
+
+static void patch_rel32(uint8_t* patch, uint8_t* target)
+{
+    int32_t rel = (int32_t) (target - (patch + 4));
+    memcpy(patch, &rel, 4);
+}
+
+// can the instruction be part of a block; r15 is the pc, so anything
+// naming it is left to the interpreter
+static int compilable(Insn* insn, uint32_t code_size)
+{
+    switch (insn->op)
+    {
+        case 1:     // load
+        case 4:     // ldaddr
+            return (uint32_t) insn->imm <= code_size && insn->r1 != 15;
+        case 3:     // ldimm
+            return insn->r1 != 15;
+        case 5:     // ldind
+        case 6:     // stind
+        case 7:     // addf
+        case 8:     // subf
+        case 9:     // divf
+        case 10:    // mulf
+        case 11:    // addi
+        case 12:    // subi
+        case 13:    // divi
+        case 14:    // muli
+            return insn->r1 != 15 && insn->r2 != 15;
+        case 17:    // blt
+        case 18:    // bgt
+        case 19:    // beq
+            return (uint32_t) insn->imm <= code_size && insn->r1 != 15 && insn->r2 != 15;
+        case 20:    // jmp
+            return (uint32_t) insn->imm <= code_size;
+        default:
+            return 0;
+    }
+}
+
+static void emit_insn(Emit* e, VM* vm, Insn* insn, int32_t pc, int32_t undone)
+{
+    switch (insn->op)
+    {
+        case 1:     // load: mov eax, [rsi + 4*imm]
+            emit1(e, 0x8b); emit1(e, 0x86); emit4(e, insn->imm * 4);
+            emit_put(e, EAX, insn->r1);
+            break;
+        case 3:     // ldimm
+        case 4:     // ldaddr
+            emit_set(e, insn->r1, insn->imm);
+            break;
+        case 5:     // ldind
+        case 6:     // stind
+            emit_get(e, EAX, insn->r2);
+            emit1(e, 0x05); emit4(e, insn->imm);                // add eax, imm
+            emit1(e, 0x3d); emit4(e, (int32_t) vm->mem_words);  // cmp eax, mem_words
+            emit_exit_jcc(e, 0x83, pc, undone);                 // jae
+            if (insn->op == 5)
+            {
+                emit1(e, 0x8b); emit1(e, 0x04); emit1(e, 0x86); // mov eax, [rsi + rax*4]
+                emit_put(e, EAX, insn->r1);
+            }
+            else
+            {
+                // stores into code have to invalidate, let the interpreter do them
+                emit1(e, 0x3d); emit4(e, vm->hdr.code_size);    // cmp eax, code_size
+                emit_exit_jcc(e, 0x86, pc, undone);             // jbe
+                emit_get(e, ECX, insn->r1);
+                emit1(e, 0x89); emit1(e, 0x0c); emit1(e, 0x86); // mov [rsi + rax*4], ecx
+            }
+            break;
+        case 7:     // addf
+        case 8:     // subf
+        case 9:     // divf
+        case 10:    // mulf
+            emit_getf(e, 0, insn->r1);
+            emit_getf(e, 1, insn->r2);
+            if (insn->op == 9)
+            {
+                emit1(e, 0x0f); emit1(e, 0x57); emit1(e, 0xd2);     // xorps xmm2, xmm2
+                emit1(e, 0x0f); emit1(e, 0x2e); emit1(e, 0xca);     // ucomiss xmm1, xmm2
+                emit1(e, 0x7a); emit1(e, 0x06);                     // jp past the exit (NaN)
+                emit_exit_jcc(e, 0x84, pc, undone);                 // je
+            }
+            emit1(e, 0xf3); emit1(e, 0x0f);
+            emit1(e, insn->op == 7 ? 0x58 : insn->op == 8 ? 0x5c : insn->op == 9 ? 0x5e : 0x59);
+            emit1(e, 0xc1);                                         // op xmm0, xmm1
+            emit_putf(e, 0, insn->r1);
+            break;
+        case 11:    // addi
+        case 12:    // subi
+        case 14:    // muli
+            emit_get(e, EAX, insn->r1);
+            if (insn->op == 14)
+                emit1(e, 0x0f);
+            emit1(e, insn->op == 11 ? 0x03 : insn->op == 12 ? 0x2b : 0xaf);
+            emit1(e, 0x47 | EAX << 3); emit1(e, 4 * insn->r2);     // op eax, [rdi + 4*r2]
+            emit_put(e, EAX, insn->r1);
+            break;
+        case 13:    // divi
+            emit_get(e, ECX, insn->r2);
+            emit1(e, 0x85); emit1(e, 0xc9);                         // test ecx, ecx
+            emit_exit_jcc(e, 0x84, pc, undone);                     // je
+            emit1(e, 0x83); emit1(e, 0xf9); emit1(e, 0xff);         // cmp ecx, -1
+            emit_exit_jcc(e, 0x84, pc, undone);                     // je
+            emit_get(e, EAX, insn->r1);
+            emit1(e, 0x99);                                         // cdq
+            emit1(e, 0xf7); emit1(e, 0xf9);                         // idiv ecx
+            emit_put(e, EAX, insn->r1);
+            break;
+    }
+}
+
+// jump back to the block start, leaving if the code was written meanwhile
+static void emit_loop(Emit* e, VM* vm, JitProc* jp, uint8_t* start, int32_t pc)
+{
+    emit1(e, 0x48); emit1(e, 0xb8);                                 // mov rax, &vm->jit_epoch
+    uint64_t addr = (uint64_t) (uintptr_t) &vm->jit_epoch;
+    memcpy(e->p, &addr, 8);
+    e->p += 8;
+    emit1(e, 0x8b); emit1(e, 0x00);                                 // mov eax, [rax]
+    emit1(e, 0x3d); emit4(e, (int32_t) jp->epoch);                  // cmp eax, epoch
+    emit_exit_jcc(e, 0x85, pc, 0);                                  // jne
+    emit1(e, 0xe9);                                                 // jmp start
+    e->p += 4;
+    patch_rel32(e->p - 4, start);
+}
+
+static void jit_flush(VM* vm, JitProc* jp)
+{
+    memset(jp->entry, 0, sizeof(void*) * (vm->hdr.code_size + 1));
+    jp->used = 0;
+    jp->epoch = atomic_load_explicit(&vm->jit_epoch, memory_order_seq_cst);
+}
+
+static void* compile_block(VM* vm, JitProc* jp, uint32_t start)
+{
+    uint32_t code_size = vm->hdr.code_size;
+    Insn insns[MAX_BLOCK];
+    int n = 0;
+
+    for (uint32_t pc = start; pc <= code_size && n < MAX_BLOCK; pc++)
+    {
+        // mark the word before reading it, so a racing write invalidates
+        uint8_t state = 0;
+        if (!atomic_compare_exchange_strong_explicit((_Atomic uint8_t*) &vm->jit_words[pc], &state,
+                JIT_WORD_COMPILED, memory_order_seq_cst, memory_order_seq_cst) &&
+                state == JIT_WORD_WRITTEN)
+            break;
+        int32_t word = atomic_load_explicit((_Atomic int32_t*) &vm->mem[pc], memory_order_seq_cst);
+        decode_word(&insns[n], word, pc);
+        if (!compilable(&insns[n], code_size))
+            break;
+        n++;
+        if (insns[n - 1].op >= 17)
+            break;
+    }
+    if (n == 0)
+        return NO_BLOCK;
+
+    if (jp->used + (size_t) n * BYTES_PER_INSN + 128 > CODE_BYTES)
+        jit_flush(vm, jp);
+    if (mprotect(jp->code, CODE_BYTES, PROT_READ | PROT_WRITE) != 0)
+        return NO_BLOCK;
+
+    Emit e;
+    e.p = jp->code + jp->used;
+    e.num_exits = 0;
+    uint8_t* entry = e.p;
+
+    emit1(&e, 0x49); emit1(&e, 0x89); emit1(&e, 0xd0);             // mov r8, rdx
+    uint8_t* top = e.p;
+    emit1(&e, 0x49); emit1(&e, 0x81); emit1(&e, 0xf8); emit4(&e, n); // cmp r8, n
+    emit_exit_jcc(&e, 0x8c, start, 0);                              // jl
+    emit1(&e, 0x49); emit1(&e, 0x81); emit1(&e, 0xe8); emit4(&e, n); // sub r8, n
+
+    Insn* last = &insns[n - 1];
+    int body = last->op >= 17 ? n - 1 : n;
+    for (int i = 0; i < body; i++)
+        emit_insn(&e, vm, &insns[i], start + i, n - i);
+
+    int32_t next = start + n;
+    if (last->op >= 17 && last->op <= 19)
+    {
+        emit_get(&e, EAX, last->r1);
+        emit1(&e, 0x3b); emit1(&e, 0x47 | EAX << 3); emit1(&e, 4 * last->r2);  // cmp eax, [r2]
+        uint8_t cc = last->op == 17 ? 0x8c : last->op == 18 ? 0x8f : 0x84;     // jl / jg / je
+        emit1(&e, 0x0f); emit1(&e, cc);
+        uint8_t* taken = e.p;
+        emit4(&e, 0);
+        emit_return(&e, next);
+        patch_rel32(taken, e.p);
+    }
+    if (last->op >= 17)
+    {
+        if ((uint32_t) last->imm == start)
+            emit_loop(&e, vm, jp, top, start);
+        else
+            emit_return(&e, last->imm);
+    }
+    else
+        emit_return(&e, next);
+
+    // side exits: put back what wasn't run, then return at the exit pc
+    for (int i = 0; i < e.num_exits; i++)
+    {
+        Exit* x = &e.exits[i];
+        patch_rel32(x->patch, e.p);
+        if (x->undone)
+        {
+            emit1(&e, 0x49); emit1(&e, 0x81); emit1(&e, 0xc0); emit4(&e, x->undone);  // add r8, undone
+        }
+        emit_return(&e, x->pc);
+    }
+
+    jp->used = e.p - jp->code;
+    if (mprotect(jp->code, CODE_BYTES, PROT_READ | PROT_EXEC) != 0)
+        return NO_BLOCK;
+    __builtin___clear_cache((char*) entry, (char*) e.p);
+    return entry;
+}
+
+int jit_begin(VM* vm)
+{
+    if (!vm->jit)
+    {
+        vm->jit = (Jit*) calloc(1, sizeof(Jit));
+        vm->jit_words = (uint8_t*) calloc(vm->hdr.code_size + 1, 1);
+        if (!vm->jit || !vm->jit_words)
+        {
+            jit_destroy(vm);
+            return 0;
+        }
+    }
+
+    Jit* jit = vm->jit;
+    if (jit->num_procs < vm->num_procs)
+    {
+        JitProc* procs = (JitProc*) realloc(jit->procs, sizeof(JitProc) * vm->num_procs);
+        if (!procs)
+            return 0;
+        jit->procs = procs;
+        for (; jit->num_procs < vm->num_procs; jit->num_procs++)
+        {
+            JitProc* jp = &procs[jit->num_procs];
+            jp->code = mmap(NULL, CODE_BYTES, PROT_READ | PROT_EXEC,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            jp->entry = (void**) calloc(vm->hdr.code_size + 1, sizeof(void*));
+            if (jp->code == MAP_FAILED || !jp->entry)
+            {
+                if (jp->code != MAP_FAILED)
+                    munmap(jp->code, CODE_BYTES);
+                free(jp->entry);
+                return 0;
+            }
+            jp->used = 0;
+            jp->epoch = atomic_load_explicit(&vm->jit_epoch, memory_order_seq_cst);
+        }
+    }
+    return 1;
+}
+
+int jit_run(VM* vm, Proc* p, int64_t budget)
+{
+    JitProc* jp = &vm->jit->procs[p->pid];
+    int32_t* regs = p->regs;
+    uint32_t code_size = vm->hdr.code_size;
+
+    while (budget > 0)
+    {
+        if (atomic_load_explicit(&vm->jit_epoch, memory_order_acquire) != jp->epoch)
+            jit_flush(vm, jp);
+
+        uint32_t pc = regs[15];
+        void* block = NO_BLOCK;
+        if (pc <= code_size)
+        {
+            block = jp->entry[pc];
+            if (!block)
+                block = jp->entry[pc] = compile_block(vm, jp, pc);
+        }
+
+        if (block != NO_BLOCK)
+        {
+            int64_t left = ((JitBlock) block)(regs, vm->mem, budget);
+            if (left != budget || (uint32_t) regs[15] != pc)
+            {
+                budget = left;
+                continue;
+            }
+        }
+
+        // the block couldn't start here, so step the interpreter once
+        int status = interp_run(vm, p, 1);
+        if (status != PROC_PREEMPTED)
+            return status;
+        budget--;
+    }
+    return PROC_PREEMPTED;
+}
+
+void jit_destroy(VM* vm)
+{
+    Jit* jit = vm->jit;
+    if (jit)
+    {
+        for (uint32_t i = 0; i < jit->num_procs; i++)
+        {
+            munmap(jit->procs[i].code, CODE_BYTES);
+            free(jit->procs[i].entry);
+        }
+        free(jit->procs);
+        free(jit);
+    }
+    free(vm->jit_words);
+    vm->jit = NULL;
+    vm->jit_words = NULL;
+}
+
+#else
+
+// no code generator for this host, execute falls back to the interpreter
+
+int jit_begin(VM* vm)
+{
+    return 0;
+}
+
+int jit_run(VM* vm, Proc* p, int64_t budget)
+{
+    return interp_run(vm, p, budget);
+}
+
+void jit_destroy(VM* vm)
+{
+}
+
+#endif
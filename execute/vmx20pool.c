@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CACHE_BUCKETS 256
+
+// A set of idle VM handles plus a cache of parsed images. A released VM
+// keeps its address space mapping, so running the same executable on it
+// again only has to throw away the pages the last run dirtied.
+typedef struct {
+    uint32_t memory_words;
+    int32_t flags;
+    pthread_mutex_t lock;
+    VM** idle;
+    int num_idle;
+    int cap_idle;
+    Image* cache[CACHE_BUCKETS];
+} Pool;
+
+static unsigned int path_hash(const char* path)
+{
+    unsigned int hash = 2166136261u;
+    for (; *path; path++)
+    {
+        hash ^= (unsigned char) *path;
+        hash *= 16777619u;
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+// check that the file behind a cached image hasn't been replaced or modified
+static int image_current(Image* img)
+{
+    struct stat st;
+    return stat(img->path, &st) == 0 && st.st_dev == img->dev && st.st_ino == img->ino &&
+        st.st_size == img->size && st.st_mtim.tv_sec == img->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == img->mtime.tv_nsec;
+}
+
+// find or parse the image for filename, returning a new reference; pool->lock is held
+static Image* cache_get(Pool* pool, char* filename, int32_t* errorNumber)
+{
+    Image** link = &pool->cache[path_hash(filename)];
+    for (; *link; link = &(*link)->next)
+    {
+        if (strcmp((*link)->path, filename) != 0)
+            continue;
+
+        if (image_current(*link))
+        {
+            image_retain(*link);
+            return *link;
+        }
+
+        // stale, drop it from the cache; VMs still running it keep their reference
+        Image* old = *link;
+        *link = old->next;
+        image_release(old);
+        break;
+    }
+
+    Image* img = image_open(filename, errorNumber);
+    if (!img)
+        return NULL;
+
+    unsigned int bucket = path_hash(filename);
+    img->next = pool->cache[bucket];
+    pool->cache[bucket] = img;
+    image_retain(img);
+    return img;
+}
+
+void *createVmPool(uint32_t numVms, uint32_t memoryWords, int32_t flags, int32_t *errorNumber)
+{
+    Pool* pool = (Pool*) calloc(1, sizeof(Pool));
+    if (!pool)
+    {
+        (*errorNumber) = VMX20_INITIALIZE_FAILURE;
+        return NULL;
+    }
+
+    pool->memory_words = memoryWords;
+    pool->flags = flags;
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->cap_idle = numVms > 0 ? numVms : 1;
+    pool->idle = (VM**) malloc(sizeof(VM*) * pool->cap_idle);
+    if (!pool->idle)
+    {
+        free(pool);
+        (*errorNumber) = VMX20_INITIALIZE_FAILURE;
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < numVms; i++)
+    {
+        VM* vm = (VM*) initVmSized(memoryWords, flags, errorNumber);
+        if (!vm)
+        {
+            destroyVmPool(pool);
+            return NULL;
+        }
+        pool->idle[pool->num_idle++] = vm;
+    }
+
+    (*errorNumber) = VMX20_NORMAL_TERMINATION;
+    return pool;
+}
+
+void *acquireVm(void *handle, char *filename, int32_t *errorNumber)
+{
+    Pool* pool = (Pool*) handle;
+
+    pthread_mutex_lock(&pool->lock);
+    Image* img = cache_get(pool, filename, errorNumber);
+    if (!img)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    // prefer an idle VM that last ran this image, it only needs a reset
+    VM* vm = NULL;
+    for (int i = pool->num_idle - 1; i >= 0; i--)
+    {
+        if (pool->idle[i]->image == img)
+        {
+            vm = pool->idle[i];
+            pool->idle[i] = pool->idle[--pool->num_idle];
+            break;
+        }
+    }
+    if (!vm && pool->num_idle > 0)
+        vm = pool->idle[--pool->num_idle];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!vm)
+    {
+        vm = (VM*) initVmSized(pool->memory_words, pool->flags, errorNumber);
+        if (!vm)
+        {
+            image_release(img);
+            return NULL;
+        }
+    }
+
+    int ok = 1;
+    if (vm->image == img)
+        vm_reset(vm);
+    else
+    {
+        if (vm->image)
+            vm_detach_image(vm);
+        ok = vm_attach_image(vm, img, errorNumber);
+    }
+    image_release(img);
+
+    if (!ok)
+    {
+        releaseVm(pool, vm);
+        return NULL;
+    }
+
+    (*errorNumber) = VMX20_NORMAL_TERMINATION;
+    return vm;
+}
+
+void releaseVm(void *handle, void *vmHandle)
+{
+    Pool* pool = (Pool*) handle;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->num_idle == pool->cap_idle)
+    {
+        VM** idle = (VM**) realloc(pool->idle, sizeof(VM*) * pool->cap_idle * 2);
+        if (!idle)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            cleanup(vmHandle);
+            return;
+        }
+        pool->idle = idle;
+        pool->cap_idle *= 2;
+    }
+    pool->idle[pool->num_idle++] = (VM*) vmHandle;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void destroyVmPool(void *handle)
+{
+    Pool* pool = (Pool*) handle;
+
+    for (int i = 0; i < pool->num_idle; i++)
+        cleanup(pool->idle[i]);
+
+    for (int i = 0; i < CACHE_BUCKETS; i++)
+    {
+        while (pool->cache[i])
+        {
+            Image* img = pool->cache[i];
+            pool->cache[i] = img->next;
+            image_release(img);
+        }
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->idle);
+    free(pool);
+}
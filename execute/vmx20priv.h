@@ -0,0 +1,336 @@
+#ifndef VMX20PRIV_H
+#define VMX20PRIV_H
+
+// Internal structures shared by the vmx20 library sources.
+
+#include "vmx20ext.h"
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <time.h>
+
+typedef struct {
+    int32_t insym_size;
+    int32_t outsym_size;
+    int32_t code_size;
+} Header;
+
+typedef struct {
+    char name[16];
+    int32_t addr;
+} Sym;
+
+// Last bytes of a version 2 executable, whose symbol table is padded so
+// the code starts on a page; the symbol index and this trailer follow the
+// code, out of sight of version 1 readers.
+typedef struct {
+    uint32_t magic;         // VMX20_EXE2_MAGIC
+    uint32_t version;
+    uint32_t num_syms;      // insymbols before the padding
+    uint32_t entry;         // address the processors start at
+    uint32_t memory_words;  // smallest address space the program runs in
+    uint32_t stack_words;   // stack each processor needs, 0 if not given
+    uint32_t index_offset;  // file offset of the symbol index
+    uint32_t index_buckets; // the index holds a seed per bucket, then
+    uint32_t index_slots;   // a symbol number (or -1) per slot, a power of two
+    uint32_t reserved;
+} ExeTrailer;
+
+// "XEX2", first word of an ExeTrailer
+#define VMX20_EXE2_MAGIC 0x32584558
+
+// pre-decoded form of one code word
+typedef struct {
+    void* handler;  // threaded-code entry point for op
+    uint8_t op;
+    uint8_t r1;
+    uint8_t r2;
+    uint8_t rx;     // third register of fused ops
+    int32_t imm;    // sign-extended constant/offset, or absolute target for pc-relative ops
+} Insn;
+
+// Fused superinstructions built by fuse_code. One sits in the entry of the
+// first word of the sequence it replaces; the other words keep their own
+// entries so that branches into the middle still work.
+#define OP_LDIMM_ADDI       0xf0    // ldimm r1, imm; addi r2, r1
+#define OP_LOAD_ADDI_STORE  0xf1    // load r1, imm; addi r1, r2; store r1, imm
+#define OP_PUSH_CALL        0xf2    // push r1; call imm
+#define OP_POP_POP          0xf3    // pop r1; pop r2
+#define OP_ADDI_BLT         0xf4    // addi r1, r2; blt r1, rx, imm
+#define OP_FUSED_BASE       OP_LDIMM_ADDI
+
+// stands in for raw opcodes that collide with the internal ops
+#define OP_ILLEGAL 0xfd
+// marks the entry one past the last code word, where execution runs off the program
+#define OP_END 0xfe
+// marks an Insn whose code word was written since it was decoded
+#define OP_STALE 0xff
+
+// A parsed .exe file. Images are reference counted so that a pool can
+// share one between every VM running the same executable.
+typedef struct Image {
+    char* path;
+    dev_t dev;          // identity of the file when it was parsed
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    Header hdr;         // insym_size leaves out the padding of version 2 files
+    Sym* syms;
+    int fd;             // kept open to map the code section into each VM
+    long code_offset;
+    ExecutableInfo info;
+    // Index of syms: the perfect hash read from a version 2 file, or for
+    // version 1 an open addressing table built at load (no seeds)
+    uint32_t* index_seeds;
+    int32_t* index_slots;   // symbol numbers, -1 for empty slots
+    uint32_t index_buckets;
+    uint32_t index_size;    // slots, a power of two
+    Insn* insns;        // decoded code section, copied into each VM
+    atomic_int refs;
+    struct Image* next; // hash chain in a pool's image cache
+} Image;
+
+// Calling-context tree node of the profiler, one per distinct call stack.
+// Node 0 is the root, the stack a processor starts with.
+typedef struct {
+    uint32_t target;        // called address, 0 for the root
+    uint32_t parent;
+    uint32_t first_child;   // 0 for none
+    uint32_t next_sibling;
+    uint64_t self;          // instructions run with exactly this stack
+} ProfNode;
+
+// VMX20_EXEC_PROFILE counts of one processor
+typedef struct {
+    uint64_t ops[VMX20_NUM_OPCODES + 1];    // the last slot counts everything else
+    uint64_t* hits;         // per code word, plus the entry past the end
+    uint64_t* taken;        // per blt/bgt/beq address
+    uint64_t* not_taken;
+    uint64_t* calls;        // per call target
+    ProfNode* nodes;
+    uint32_t num_nodes;
+    uint32_t cap_nodes;
+    uint32_t node;          // context of the running instruction
+} ProcProfile;
+
+// kinds of data memory access counted by VMX20_EXEC_CONTENTION
+#define ACCESS_READ     0
+#define ACCESS_WRITE    1
+#define ACCESS_CAS_OK   2
+#define ACCESS_CAS_FAIL 3
+
+// accesses of one processor to one word, a slot of a ProcContention table
+typedef struct {
+    uint32_t key;           // address + 1, 0 for an empty slot
+    uint32_t last_pid;      // while merging: pid + 1 of the last processor counted
+    uint32_t processors;    // while merging: processors that made the accesses
+    uint32_t shared_words;  // while merging lines: words with several processors
+    uint64_t counts[4];     // per ACCESS_* kind
+} AccessCount;
+
+// VMX20_EXEC_CONTENTION counts of one processor for one execute call
+typedef struct {
+    AccessCount* table;     // open addressing on the address, 1 << bits slots
+    uint32_t bits;
+    uint32_t used;
+    uint64_t instructions;
+    uint64_t lock_wait_ns;
+    uint64_t queue_wait_ns;
+    uint64_t queued_at;     // when the processor last went into the run queue
+} ProcContention;
+
+// state of one simulated processor, kept between time slices
+typedef struct {
+    int32_t regs[16];
+    int pid;
+    int status;         // termination status once the processor stops
+    int64_t budget;     // instructions left of the instruction budget
+    // VMX20_EXEC_PAIRS counts, indexed by previous and current opcode
+    int last_op;
+    uint64_t pairs[VMX20_NUM_OPCODES][VMX20_NUM_OPCODES];
+    ProcProfile* prof;      // VMX20_EXEC_PROFILE counts, NULL when not profiling
+    ProcContention* stats;  // VMX20_EXEC_CONTENTION counts, NULL when not collected
+} Proc;
+
+// returned by execute_helper when a processor used up its time slice
+#define PROC_PREEMPTED (-1)
+
+// jit_words states: a word that was compiled and then written is left to
+// the interpreter from then on, so self-modifying loops don't recompile
+#define JIT_WORD_COMPILED 1
+#define JIT_WORD_WRITTEN 2
+
+// registers and status of a processor in a snapshot
+typedef struct {
+    int32_t regs[16];
+    int32_t status;
+} ProcState;
+
+// A VM's memory and processors at one point. The memory is a file, a memfd
+// or a snapshot file, that restore maps copy-on-write.
+typedef struct {
+    Image* image;
+    uint32_t mem_words;
+    int fd;
+    off_t mem_offset;       // where word 0 is in fd, page aligned
+    uint32_t num_procs;
+    ProcState* procs;
+} Snapshot;
+
+// "XSNP", first word of a snapshot file
+#define SNAPSHOT_MAGIC 0x504e5358
+
+// Snapshot file layout: SnapshotFileHeader, a ProcState per processor, the
+// executable's path, then from mem_offset the memory, with holes for pages
+// of zeroes.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mem_words;
+    uint32_t num_procs;
+    uint32_t path_len;
+    uint32_t reserved;
+    int64_t exe_size;       // identity of the executable, to spot a rebuilt one
+    int64_t exe_mtime_sec;
+    int64_t exe_mtime_nsec;
+    int64_t mem_offset;
+} SnapshotFileHeader;
+
+typedef struct Workers Workers;
+typedef struct Tracer Tracer;
+typedef struct Jit Jit;
+
+typedef struct {
+    Header hdr;
+    Sym* syms;
+    Image* image;
+    uint32_t mem_words;     // size of the address space
+    int32_t flags;          // VMX20_MEM_* flags from initVmSized
+    int32_t* mem;
+    void* map_base;     // start of the mapping holding mem, NULL when mem was calloc'd
+    size_t map_len;
+    int restored;       // mem came from a snapshot rather than the image
+    Insn* insns;
+    int32_t fusions;        // VMX20_FUSE_* kinds applied to insns
+    uint64_t pair_counts[VMX20_NUM_OPCODES][VMX20_NUM_OPCODES];  // summed VMX20_EXEC_PAIRS counts
+    Tracer* tracer;         // trace rings and output file, NULL until first traced
+    ProcProfile* profiles;  // per processor, kept until resetProfile or a new executable
+    uint32_t num_profiles;
+    ProcContention* contention; // of the last execute call with VMX20_EXEC_CONTENTION
+    uint32_t num_contention;
+    // native code for VMX20_EXEC_JIT runs, NULL until first used
+    Jit* jit;
+    uint8_t* jit_words;     // JIT_WORD_* state of each code word
+    atomic_uint jit_epoch;  // bumped when such a word is written
+    // processors of the current execute call
+    Proc* procs;
+    uint32_t num_procs;
+    int32_t exec_flags;     // trace argument of execute
+    // persistent OS threads the processors run on
+    Workers* workers;
+    uint32_t max_threads;   // 0 for one thread per processor
+    int32_t worker_flags;   // VMX20_WORKERS_* flags
+    uint64_t budget;        // setInstructionBudget limit, 0 for none
+} VM;
+
+// open and parse an .exe, NULL with *errorNumber set if it isn't usable
+Image* image_open(const char* filename, int32_t* errorNumber);
+
+// hash of a symbol name in the symbol index
+uint32_t image_hash(const char* name, uint32_t seed);
+
+// the symbol named label in img, NULL if there is none
+Sym* image_find_sym(Image* img, const char* label);
+
+// take or drop a reference, the last one frees the image
+void image_retain(Image* img);
+void image_release(Image* img);
+
+// give vm its own memory and decoded code for img
+int vm_attach_image(VM* vm, Image* img, int32_t* errorNumber);
+
+// free the memory and decoded code of vm's current image
+void vm_detach_image(VM* vm);
+
+// handler addresses of the threaded interpreter, indexed by op
+extern void** threaded_handlers;
+
+// decode the code word at index into its pre-decoded form
+void decode_word(Insn* insn, int32_t word, int32_t index);
+
+// replace sequences in decoded code with fused superinstructions of the
+// kinds in mask
+void fuse_code(Insn* insns, uint32_t code_size, int32_t mask);
+
+// re-decode vm's code from its memory and fuse it with vm->fusions
+void vm_refuse(VM* vm);
+
+// run one processor for at most budget instructions; returns its
+// termination status, or PROC_PREEMPTED if the budget ran out first
+int execute_helper(VM* vm, Proc* p, int64_t budget);
+
+// execute_helper without the JIT
+int interp_run(VM* vm, Proc* p, int64_t budget);
+
+// set up compiled code for the processors of the next execute call,
+// 0 if the JIT isn't available
+int jit_begin(VM* vm);
+
+// execute_helper with the JIT
+int jit_run(VM* vm, Proc* p, int64_t budget);
+
+// drop all compiled code
+void jit_destroy(VM* vm);
+
+// give each processor of the next execute call its profile
+void profile_begin(VM* vm);
+
+// context node for calling target from the current one, created on first use
+uint32_t profile_enter(ProcProfile* prof, uint32_t target);
+
+// free every processor's profile
+void profile_destroy(VM* vm);
+
+// give each processor of the next execute call empty contention counts
+void contention_begin(VM* vm);
+
+// count one access of kind ACCESS_* to address
+void contention_access(ProcContention* stats, uint32_t address, int kind);
+
+// monotonic clock for the contention timings, in nanoseconds
+uint64_t contention_now();
+
+// free the contention counts
+void contention_destroy(VM* vm);
+
+// run the processors of vm->procs whose status is PROC_PREEMPTED until they
+// stop, then report every processor's status like execute
+int32_t run_procs(VM* vm, int terminationStatus[], int32_t trace);
+
+// unmap or free vm's memory
+void vm_free_memory(VM* vm);
+
+// run the processors of vm->procs whose status is PROC_PREEMPTED on the
+// worker threads until they stop
+void workers_run(VM* vm);
+
+// stop and join the worker threads
+void workers_destroy(VM* vm);
+
+// start or stop the trace writer around a traced execute call
+void trace_begin(VM* vm);
+void trace_end(VM* vm);
+
+// record the instruction about to run and the registers of processor pid
+void trace_step(VM* vm, int pid, int32_t* regs);
+
+// close the trace file and free the trace rings
+void trace_destroy(VM* vm);
+
+// return memory and decoded code to their state right after loading,
+// touching only the pages that were committed since
+void vm_reset(VM* vm);
+
+#endif
@@ -0,0 +1,264 @@
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// VMX20_EXEC_PROFILE counts. Each processor counts into its own
+// ProcProfile, so the run_instrumented interpreter needs no atomics; the
+// reports below merge nothing and list processors one after another.
+
+static const char* op_names[VMX20_NUM_OPCODES + 1] = {
+    "halt", "load", "store", "ldimm", "ldaddr", "ldind", "stind", "addf", "subf",
+    "divf", "mulf", "addi", "subi", "divi", "muli", "call", "ret", "blt", "bgt",
+    "beq", "jmp", "cmpxchg", "getpid", "getpn", "push", "pop", "other",
+};
+
+static void* profile_calloc(size_t count, size_t size)
+{
+    void* p = calloc(count, size);
+    if (!p)
+    {
+        printf("ERROR: Could not allocate profile\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void profile_free(ProcProfile* prof)
+{
+    free(prof->hits);
+    free(prof->taken);
+    free(prof->not_taken);
+    free(prof->calls);
+    free(prof->nodes);
+}
+
+void profile_begin(VM* vm)
+{
+    uint32_t words = vm->hdr.code_size + 2;
+    if (vm->num_profiles < vm->num_procs)
+    {
+        vm->profiles = (ProcProfile*) realloc(vm->profiles, sizeof(ProcProfile) * vm->num_procs);
+        if (!vm->profiles)
+        {
+            printf("ERROR: Could not allocate profile\n");
+            exit(1);
+        }
+        memset(&vm->profiles[vm->num_profiles], 0,
+            sizeof(ProcProfile) * (vm->num_procs - vm->num_profiles));
+        vm->num_profiles = vm->num_procs;
+    }
+
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+    {
+        ProcProfile* prof = &vm->profiles[i];
+        if (!prof->hits)
+        {
+            prof->hits = (uint64_t*) profile_calloc(words, sizeof(uint64_t));
+            prof->taken = (uint64_t*) profile_calloc(words, sizeof(uint64_t));
+            prof->not_taken = (uint64_t*) profile_calloc(words, sizeof(uint64_t));
+            prof->calls = (uint64_t*) profile_calloc(words, sizeof(uint64_t));
+            prof->cap_nodes = 64;
+            prof->nodes = (ProfNode*) profile_calloc(prof->cap_nodes, sizeof(ProfNode));
+            prof->num_nodes = 1;
+        }
+        // every execute call starts over at the entry point with an empty stack
+        prof->node = 0;
+        vm->procs[i].prof = prof;
+    }
+}
+
+uint32_t profile_enter(ProcProfile* prof, uint32_t target)
+{
+    ProfNode* parent = &prof->nodes[prof->node];
+    for (uint32_t c = parent->first_child; c; c = prof->nodes[c].next_sibling)
+    {
+        if (prof->nodes[c].target == target)
+            return c;
+    }
+
+    if (prof->num_nodes == prof->cap_nodes)
+    {
+        prof->cap_nodes *= 2;
+        prof->nodes = (ProfNode*) realloc(prof->nodes, sizeof(ProfNode) * prof->cap_nodes);
+        if (!prof->nodes)
+        {
+            printf("ERROR: Could not allocate profile\n");
+            exit(1);
+        }
+    }
+
+    uint32_t n = prof->num_nodes++;
+    ProfNode* node = &prof->nodes[n];
+    node->target = target;
+    node->parent = prof->node;
+    node->first_child = 0;
+    node->next_sibling = prof->nodes[prof->node].first_child;
+    node->self = 0;
+    prof->nodes[prof->node].first_child = n;
+    return n;
+}
+
+void profile_destroy(VM* vm)
+{
+    for (uint32_t i = 0; i < vm->num_profiles; i++)
+        profile_free(&vm->profiles[i]);
+    free(vm->profiles);
+    vm->profiles = NULL;
+    vm->num_profiles = 0;
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+        vm->procs[i].prof = NULL;
+}
+
+// profile of pid, NULL when it never ran profiled
+static ProcProfile* get_profile(VM* vm, uint32_t pid)
+{
+    if (pid >= vm->num_profiles || !vm->profiles[pid].hits)
+        return NULL;
+    return &vm->profiles[pid];
+}
+
+int32_t getOpcodeCounts(void *handle, uint32_t pid, uint64_t counts[VMX20_NUM_OPCODES])
+{
+    VM* vm = (VM*) handle;
+    ProcProfile* prof = get_profile(vm, pid);
+    if (!prof)
+        return 0;
+
+    memcpy(counts, prof->ops, sizeof(uint64_t) * VMX20_NUM_OPCODES);
+    return 1;
+}
+
+int32_t getAddressProfile(void *handle, uint32_t pid, uint32_t address, AddressProfile *out)
+{
+    VM* vm = (VM*) handle;
+    ProcProfile* prof = get_profile(vm, pid);
+    if (!prof || address > (uint32_t) vm->hdr.code_size)
+        return 0;
+
+    out->hits = prof->hits[address];
+    out->taken = prof->taken[address];
+    out->notTaken = prof->not_taken[address];
+    out->calls = prof->calls[address];
+    return 1;
+}
+
+int32_t symbolize(void *handle, uint32_t address, char *buffer, int32_t size)
+{
+    VM* vm = (VM*) handle;
+    Sym* best = NULL;
+    for (int i = 0; i < vm->hdr.insym_size / 5; i++)
+    {
+        Sym* sym = &vm->syms[i];
+        if ((uint32_t) sym->addr <= address && (!best || sym->addr > best->addr))
+            best = sym;
+    }
+
+    if (!best)
+        snprintf(buffer, size, "%u", address);
+    else if ((uint32_t) best->addr == address)
+        snprintf(buffer, size, "%.16s", best->name);
+    else
+        snprintf(buffer, size, "%.16s+%u", best->name, address - best->addr);
+    return best != NULL;
+}
+
+int32_t writeProfile(void *handle, char *filename)
+{
+    VM* vm = (VM*) handle;
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return 0;
+
+    for (uint32_t pid = 0; pid < vm->num_profiles; pid++)
+    {
+        ProcProfile* prof = get_profile(vm, pid);
+        if (!prof)
+            continue;
+
+        fprintf(file, "processor %u\n", pid);
+        for (int op = 0; op <= VMX20_NUM_OPCODES; op++)
+        {
+            if (prof->ops[op])
+                fprintf(file, "  %-8s %llu\n", op_names[op], (unsigned long long) prof->ops[op]);
+        }
+
+        fprintf(file, "  %-8s %-24s %12s %12s %12s %12s  %s\n",
+            "address", "symbol", "hits", "taken", "not_taken", "calls", "instruction");
+        for (uint32_t addr = 0; addr <= (uint32_t) vm->hdr.code_size; addr++)
+        {
+            if (!prof->hits[addr] && !prof->calls[addr])
+                continue;
+
+            char sym[40];
+            char insn[100];
+            int32_t err = 0;
+            symbolize(vm, addr, sym, sizeof(sym));
+            if (!disassembleWord(vm->mem[addr], insn, &err))
+                insn[0] = '\0';
+            insn[strcspn(insn, "\n")] = '\0';
+            fprintf(file, "  %-8u %-24s %12llu %12llu %12llu %12llu  %s\n", addr, sym,
+                (unsigned long long) prof->hits[addr], (unsigned long long) prof->taken[addr],
+                (unsigned long long) prof->not_taken[addr], (unsigned long long) prof->calls[addr],
+                insn);
+        }
+    }
+
+    fclose(file);
+    return 1;
+}
+
+// frames from the root down to node n, separated by ';'. Walks up into
+// path first, since stacks of deep recursion are too deep to recurse on.
+static void write_stack(FILE* file, VM* vm, ProcProfile* prof, uint32_t n, uint32_t* path)
+{
+    uint32_t depth = 0;
+    for (; n; n = prof->nodes[n].parent)
+        path[depth++] = n;
+
+    char sym[40];
+    symbolize(vm, vm->image->info.entry, sym, sizeof(sym));
+    fprintf(file, "%s", sym);
+    while (depth > 0)
+    {
+        symbolize(vm, prof->nodes[path[--depth]].target, sym, sizeof(sym));
+        fprintf(file, ";%s", sym);
+    }
+}
+
+int32_t writeCollapsedStacks(void *handle, char *filename)
+{
+    VM* vm = (VM*) handle;
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return 0;
+
+    for (uint32_t pid = 0; pid < vm->num_profiles; pid++)
+    {
+        ProcProfile* prof = get_profile(vm, pid);
+        if (!prof)
+            continue;
+
+        uint32_t* path = (uint32_t*) profile_calloc(prof->num_nodes, sizeof(uint32_t));
+        for (uint32_t n = 0; n < prof->num_nodes; n++)
+        {
+            if (!prof->nodes[n].self)
+                continue;
+            fprintf(file, "p%u;", pid);
+            write_stack(file, vm, prof, n, path);
+            fprintf(file, " %llu\n", (unsigned long long) prof->nodes[n].self);
+        }
+        free(path);
+    }
+
+    fclose(file);
+    return 1;
+}
+
+void resetProfile(void *handle)
+{
+    profile_destroy((VM*) handle);
+}
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Snapshots keep memory in a file, a memfd for snapshot() and the snapshot
+// file itself for loadSnapshot(), so that restore can map it privately:
+// every VM restored from a snapshot shares its pages until it writes them.
+
+static size_t page_size()
+{
+    return sysconf(_SC_PAGESIZE);
+}
+
+// bytes of memory for mem_words words, rounded up to whole pages
+static size_t mem_bytes(uint32_t mem_words)
+{
+    size_t page = page_size();
+    return (sizeof(int32_t) * (size_t) mem_words + page - 1) / page * page;
+}
+
+// whether len bytes at p are all zero; len need not be a multiple of 8
+static int all_zero(const char* p, size_t len)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t v;
+        memcpy(&v, p + i, sizeof(v));
+        if (v)
+            return 0;
+    }
+    for (; i < len; i++)
+    {
+        if (p[i])
+            return 0;
+    }
+    return 1;
+}
+
+// copy bytes of memory into fd at offset, leaving holes for zero pages
+static int write_pages(int fd, off_t offset, const char* mem, size_t bytes)
+{
+    size_t page = page_size();
+    for (size_t at = 0; at < bytes; at += page)
+    {
+        size_t len = bytes - at < page ? bytes - at : page;
+        if (!all_zero(mem + at, len) && pwrite(fd, mem + at, len, offset + at) != (ssize_t) len)
+            return 0;
+    }
+    return 1;
+}
+
+static Snapshot* snapshot_alloc(uint32_t num_procs)
+{
+    Snapshot* snap = (Snapshot*) calloc(1, sizeof(Snapshot));
+    ProcState* procs = (ProcState*) calloc(num_procs ? num_procs : 1, sizeof(ProcState));
+    if (!snap || !procs)
+    {
+        printf("ERROR: Could not allocate snapshot\n");
+        exit(1);
+    }
+    snap->procs = procs;
+    snap->num_procs = num_procs;
+    snap->fd = -1;
+    return snap;
+}
+
+void *snapshot(void *handle)
+{
+    VM* vm = (VM*) handle;
+    if (!vm->image)
+        return NULL;
+
+    Snapshot* snap = snapshot_alloc(vm->num_procs);
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+    {
+        memcpy(snap->procs[i].regs, vm->procs[i].regs, sizeof(snap->procs[i].regs));
+        snap->procs[i].status = vm->procs[i].status;
+    }
+
+    // pages that were never written read as zeroes and stay holes
+    size_t bytes = sizeof(int32_t) * (size_t) vm->mem_words;
+    snap->fd = memfd_create("vmx20-snapshot", MFD_CLOEXEC);
+    if (snap->fd < 0 || ftruncate(snap->fd, mem_bytes(vm->mem_words)) != 0 ||
+            !write_pages(snap->fd, 0, (const char*) vm->mem, bytes))
+    {
+        destroySnapshot(snap);
+        return NULL;
+    }
+
+    image_retain(vm->image);
+    snap->image = vm->image;
+    snap->mem_words = vm->mem_words;
+    snap->mem_offset = 0;
+    return snap;
+}
+
+int32_t restore(void *handle, void *snapHandle)
+{
+    VM* vm = (VM*) handle;
+    Snapshot* snap = (Snapshot*) snapHandle;
+    if (vm->mem_words != snap->mem_words)
+        return 0;
+
+    if (vm->image != snap->image)
+    {
+        int32_t err = 0;
+        if (vm->image)
+            vm_detach_image(vm);
+        if (!vm_attach_image(vm, snap->image, &err))
+            return 0;
+    }
+    jit_destroy(vm);
+    profile_destroy(vm);
+    contention_destroy(vm);
+
+    size_t len = mem_bytes(vm->mem_words);
+    void* base = MAP_FAILED;
+#ifndef VMX20_NO_MMAP
+    int populate = (vm->flags & VMX20_MEM_DENSE) ? MAP_POPULATE : 0;
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | populate, snap->fd,
+        snap->mem_offset);
+#endif
+    if (base != MAP_FAILED)
+    {
+        vm_free_memory(vm);
+        vm->map_base = base;
+        vm->map_len = len;
+        vm->mem = (int32_t*) base;
+    }
+    else
+    {
+        // holes read back as zeroes
+        size_t bytes = sizeof(int32_t) * (size_t) vm->mem_words;
+        if (pread(snap->fd, vm->mem, bytes, snap->mem_offset) != (ssize_t) bytes)
+            return 0;
+    }
+    vm->restored = 1;
+
+    // code may have been written before the snapshot was taken
+    vm_refuse(vm);
+
+    Proc* procs = (Proc*) realloc(vm->procs, sizeof(Proc) * (snap->num_procs ? snap->num_procs : 1));
+    if (!procs)
+    {
+        printf("ERROR: Could not allocate processors\n");
+        exit(1);
+    }
+    vm->procs = procs;
+    vm->num_procs = snap->num_procs;
+    for (uint32_t i = 0; i < snap->num_procs; i++)
+    {
+        memcpy(procs[i].regs, snap->procs[i].regs, sizeof(procs[i].regs));
+        procs[i].status = snap->procs[i].status;
+        procs[i].pid = i;
+        procs[i].prof = NULL;
+        procs[i].stats = NULL;
+    }
+    return 1;
+}
+
+int32_t saveSnapshot(void *snapHandle, char *filename)
+{
+    Snapshot* snap = (Snapshot*) snapHandle;
+    Image* img = snap->image;
+
+    SnapshotFileHeader head;
+    memset(&head, 0, sizeof(head));
+    head.magic = SNAPSHOT_MAGIC;
+    head.version = 1;
+    head.mem_words = snap->mem_words;
+    head.num_procs = snap->num_procs;
+    head.path_len = strlen(img->path);
+    head.exe_size = img->size;
+    head.exe_mtime_sec = img->mtime.tv_sec;
+    head.exe_mtime_nsec = img->mtime.tv_nsec;
+    size_t page = page_size();
+    size_t front = sizeof(head) + sizeof(ProcState) * snap->num_procs + head.path_len;
+    head.mem_offset = (front + page - 1) / page * page;
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+
+    size_t len = mem_bytes(snap->mem_words);
+    int ok = pwrite(fd, &head, sizeof(head), 0) == (ssize_t) sizeof(head) &&
+        pwrite(fd, snap->procs, sizeof(ProcState) * snap->num_procs, sizeof(head)) ==
+            (ssize_t) (sizeof(ProcState) * snap->num_procs) &&
+        pwrite(fd, img->path, head.path_len, front - head.path_len) == (ssize_t) head.path_len &&
+        ftruncate(fd, head.mem_offset + len) == 0;
+
+    // the memory goes through a mapping of the snapshot, holes and all
+    const char* mem = ok ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, snap->fd, snap->mem_offset) :
+        MAP_FAILED;
+    ok = ok && mem != MAP_FAILED && write_pages(fd, head.mem_offset, mem, len);
+    if (mem != MAP_FAILED)
+        munmap((void*) mem, len);
+    return close(fd) == 0 && ok;
+}
+
+void *loadSnapshot(char *filename, int32_t *errorNumber)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        (*errorNumber) = VMX20_FILE_NOT_FOUND;
+        return NULL;
+    }
+
+    // the processors and the path must fit ahead of the memory, which must
+    // fit in the file, before anything is allocated for them
+    SnapshotFileHeader head;
+    struct stat st;
+    if (pread(fd, &head, sizeof(head), 0) != (ssize_t) sizeof(head) ||
+            head.magic != SNAPSHOT_MAGIC || head.version != 1 || head.path_len >= 4096 ||
+            head.mem_offset < (int64_t) (sizeof(head) +
+                sizeof(ProcState) * (uint64_t) head.num_procs + head.path_len) ||
+            head.mem_offset % page_size() != 0 || fstat(fd, &st) != 0 ||
+            st.st_size < head.mem_offset + (off_t) mem_bytes(head.mem_words))
+    {
+        close(fd);
+        (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
+        return NULL;
+    }
+
+    Snapshot* snap = snapshot_alloc(head.num_procs);
+    snap->fd = fd;
+    snap->mem_words = head.mem_words;
+    snap->mem_offset = head.mem_offset;
+    char path[4096];
+    size_t proc_bytes = sizeof(ProcState) * head.num_procs;
+    if (pread(fd, snap->procs, proc_bytes, sizeof(head)) != (ssize_t) proc_bytes ||
+            pread(fd, path, head.path_len, sizeof(head) + proc_bytes) != (ssize_t) head.path_len)
+    {
+        destroySnapshot(snap);
+        (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
+        return NULL;
+    }
+    path[head.path_len] = '\0';
+
+    snap->image = image_open(path, errorNumber);
+    if (!snap->image)
+    {
+        destroySnapshot(snap);
+        return NULL;
+    }
+    if (snap->image->size != head.exe_size || snap->image->mtime.tv_sec != head.exe_mtime_sec ||
+            snap->image->mtime.tv_nsec != head.exe_mtime_nsec)
+    {
+        destroySnapshot(snap);
+        (*errorNumber) = VMX20_FILE_IS_NOT_VALID;
+        return NULL;
+    }
+    return snap;
+}
+
+void destroySnapshot(void *snapHandle)
+{
+    Snapshot* snap = (Snapshot*) snapHandle;
+    if (!snap)
+        return;
+    if (snap->fd >= 0)
+        close(snap->fd);
+    if (snap->image)
+        image_release(snap->image);
+    free(snap->procs);
+    free(snap);
+}
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// VMX20_EXEC_CONTENTION counts. Each processor counts its data memory
+// accesses into a table of its own while running; executeWithStats merges
+// the tables afterwards to find the words and cache lines more than one
+// processor touched.
+
+// starting size of a processor's table, as a power of two
+#define TABLE_BITS 10
+
+static void* stats_calloc(size_t count, size_t size)
+{
+    void* p = calloc(count, size);
+    if (!p)
+    {
+        printf("ERROR: Could not allocate contention counts\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint32_t slot_of(uint32_t key, uint32_t bits)
+{
+    return (key * 0x9e3779b1u) >> (32 - bits);
+}
+
+// slot for key in table, either holding it or empty
+static AccessCount* table_find(AccessCount* table, uint32_t bits, uint32_t key)
+{
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = slot_of(key, bits);
+    while (table[i].key && table[i].key != key)
+        i = (i + 1) & mask;
+    return &table[i];
+}
+
+// double the table once it is half full
+static void table_grow(AccessCount** table, uint32_t* bits, uint32_t used)
+{
+    if (used * 2 < (1u << *bits))
+        return;
+
+    uint32_t old_bits = (*bits)++;
+    AccessCount* old = *table;
+    *table = (AccessCount*) stats_calloc((size_t) 1 << *bits, sizeof(AccessCount));
+    for (uint32_t i = 0; i < (1u << old_bits); i++)
+    {
+        if (old[i].key)
+            *table_find(*table, *bits, old[i].key) = old[i];
+    }
+    free(old);
+}
+
+uint64_t contention_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void contention_begin(VM* vm)
+{
+    contention_destroy(vm);
+    vm->contention = (ProcContention*) stats_calloc(vm->num_procs ? vm->num_procs : 1,
+        sizeof(ProcContention));
+    vm->num_contention = vm->num_procs;
+
+    uint64_t now = contention_now();
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+    {
+        ProcContention* stats = &vm->contention[i];
+        stats->bits = TABLE_BITS;
+        stats->table = (AccessCount*) stats_calloc((size_t) 1 << TABLE_BITS, sizeof(AccessCount));
+        stats->queued_at = now;
+        vm->procs[i].stats = stats;
+    }
+}
+
+void contention_access(ProcContention* stats, uint32_t address, int kind)
+{
+    AccessCount* slot = table_find(stats->table, stats->bits, address + 1);
+    if (!slot->key)
+    {
+        table_grow(&stats->table, &stats->bits, stats->used + 1);
+        slot = table_find(stats->table, stats->bits, address + 1);
+        slot->key = address + 1;
+        stats->used++;
+    }
+    slot->counts[kind]++;
+}
+
+void contention_destroy(VM* vm)
+{
+    for (uint32_t i = 0; i < vm->num_contention; i++)
+        free(vm->contention[i].table);
+    free(vm->contention);
+    vm->contention = NULL;
+    vm->num_contention = 0;
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+        vm->procs[i].stats = NULL;
+}
+
+// fold one processor's count for key into a merged table
+static void merge_count(AccessCount** table, uint32_t* bits, uint32_t* used, uint32_t key,
+    uint32_t pid, AccessCount* from)
+{
+    AccessCount* slot = table_find(*table, *bits, key);
+    if (!slot->key)
+    {
+        table_grow(table, bits, *used + 1);
+        slot = table_find(*table, *bits, key);
+        slot->key = key;
+        (*used)++;
+    }
+    if (slot->last_pid != pid + 1)
+    {
+        slot->last_pid = pid + 1;
+        slot->processors++;
+    }
+    for (int k = 0; k < 4; k++)
+        slot->counts[k] += from->counts[k];
+}
+
+static void to_shared(AccessCount* from, uint32_t address, SharedStats* out)
+{
+    out->address = address;
+    out->processors = from->processors;
+    out->reads = from->counts[ACCESS_READ];
+    out->writes = from->counts[ACCESS_WRITE];
+    out->cmpxchgSuccess = from->counts[ACCESS_CAS_OK];
+    out->cmpxchgFailure = from->counts[ACCESS_CAS_FAIL];
+    out->sharedWords = from->shared_words;
+}
+
+static uint64_t total_of(AccessCount* c)
+{
+    return c->counts[0] + c->counts[1] + c->counts[2] + c->counts[3];
+}
+
+static int by_total_desc(const void* a, const void* b)
+{
+    uint64_t x = total_of(*(AccessCount**) a);
+    uint64_t y = total_of(*(AccessCount**) b);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Words vm->mem starts into its first host cache line. Mapped memory starts
+// wherever the code sits in its page, so lines are counted from host
+// addresses, not from word 0.
+static uint32_t line_skew(VM* vm)
+{
+    return (uintptr_t) vm->mem % (sizeof(int32_t) * VMX20_CACHE_LINE_WORDS) / sizeof(int32_t);
+}
+
+// key of the host cache line holding the word with key word_key
+static uint32_t line_key(uint32_t word_key, uint32_t skew)
+{
+    return (word_key - 1 + skew) / VMX20_CACHE_LINE_WORDS + 1;
+}
+
+// the most accessed entries of table that several processors touched and
+// at least one wrote, into out; key k covers words from
+// (k - 1) * words_per_key - skew
+static uint32_t pick_hot(AccessCount* table, uint32_t bits, uint32_t used, uint32_t words_per_key,
+    uint32_t skew, SharedStats* out)
+{
+    AccessCount** hot = (AccessCount**) stats_calloc(used ? used : 1, sizeof(AccessCount*));
+    uint32_t num_hot = 0;
+    for (uint32_t i = 0; i < (1u << bits); i++)
+    {
+        AccessCount* c = &table[i];
+        if (c->key && c->processors > 1 &&
+                c->counts[ACCESS_WRITE] + c->counts[ACCESS_CAS_OK] > 0)
+            hot[num_hot++] = c;
+    }
+
+    qsort(hot, num_hot, sizeof(AccessCount*), by_total_desc);
+    if (num_hot > VMX20_STATS_HOT)
+        num_hot = VMX20_STATS_HOT;
+    for (uint32_t i = 0; i < num_hot; i++)
+    {
+        uint32_t first = (hot[i]->key - 1) * words_per_key;
+        to_shared(hot[i], first > skew ? first - skew : 0, &out[i]);
+    }
+    free(hot);
+    return num_hot;
+}
+
+int32_t executeWithStats(void *handle, uint32_t numProcessors, uint32_t initialSP[],
+    int terminationStatus[], int32_t trace, ProcStats procStats[], SharingStats *sharing)
+{
+    VM* vm = (VM*) handle;
+    int32_t ok = execute(vm, numProcessors, initialSP, terminationStatus,
+        trace | VMX20_EXEC_CONTENTION);
+
+    uint32_t skew = line_skew(vm);
+    uint32_t word_bits = TABLE_BITS;
+    uint32_t line_bits = TABLE_BITS;
+    uint32_t words_used = 0;
+    uint32_t lines_used = 0;
+    AccessCount* words = (AccessCount*) stats_calloc((size_t) 1 << word_bits, sizeof(AccessCount));
+    AccessCount* lines = (AccessCount*) stats_calloc((size_t) 1 << line_bits, sizeof(AccessCount));
+
+    for (uint32_t pid = 0; pid < vm->num_contention; pid++)
+    {
+        ProcContention* stats = &vm->contention[pid];
+        ProcStats* out = &procStats[pid];
+        memset(out, 0, sizeof(*out));
+        out->instructions = stats->instructions;
+        out->lockWaitNs = stats->lock_wait_ns;
+        out->queueWaitNs = stats->queue_wait_ns;
+
+        for (uint32_t i = 0; i < (1u << stats->bits); i++)
+        {
+            AccessCount* c = &stats->table[i];
+            if (!c->key)
+                continue;
+            out->cmpxchgSuccess += c->counts[ACCESS_CAS_OK];
+            out->cmpxchgFailure += c->counts[ACCESS_CAS_FAIL];
+            merge_count(&words, &word_bits, &words_used, c->key, pid, c);
+            merge_count(&lines, &line_bits, &lines_used, line_key(c->key, skew), pid, c);
+        }
+    }
+
+    for (uint32_t i = 0; i < (1u << word_bits); i++)
+    {
+        if (words[i].key && words[i].processors > 1)
+            table_find(lines, line_bits, line_key(words[i].key, skew))->shared_words++;
+    }
+
+    sharing->numHotWords = pick_hot(words, word_bits, words_used, 1, 0, sharing->hotWords);
+    sharing->numHotLines = pick_hot(lines, line_bits, lines_used, VMX20_CACHE_LINE_WORDS, skew,
+        sharing->hotLines);
+
+    free(words);
+    free(lines);
+    return ok;
+}
+
+int32_t getAddressContention(void *handle, uint32_t address, SharedStats *out)
+{
+    VM* vm = (VM*) handle;
+    if (!vm->contention)
+        return 0;
+
+    AccessCount sum;
+    memset(&sum, 0, sizeof(sum));
+    for (uint32_t pid = 0; pid < vm->num_contention; pid++)
+    {
+        ProcContention* stats = &vm->contention[pid];
+        AccessCount* c = table_find(stats->table, stats->bits, address + 1);
+        if (!c->key)
+            continue;
+        sum.processors++;
+        for (int k = 0; k < 4; k++)
+            sum.counts[k] += c->counts[k];
+    }
+
+    to_shared(&sum, address, out);
+    return 1;
+}
@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// records per processor ring, a power of two
+#define RING_RECORDS 4096
+
+// output buffer of the trace file, so the writer hands the kernel big blocks
+#define FILE_BUFFER (1 << 20)
+
+#define DEFAULT_TRACE_FILE "vmx20.trace"
+
+// Single-producer ring of one processor's trace records. Only the thread
+// currently running the processor writes head and only the writer thread
+// writes tail; they live on separate cache lines.
+typedef struct {
+    TraceRecord* records;
+    _Alignas(64) atomic_uint_fast64_t head;
+    _Alignas(64) atomic_uint_fast64_t tail;
+} TraceRing;
+
+// Per-VM trace state. Processors fill their rings without locking and a
+// background writer drains them to the trace file while execute runs.
+struct Tracer {
+    FILE* file;
+    char* file_buffer;
+    TraceRing* rings;
+    uint32_t num_rings;
+    pthread_t writer;
+    atomic_int stop;
+};
+
+static Tracer* tracer_get(VM* vm)
+{
+    if (!vm->tracer)
+    {
+        vm->tracer = (Tracer*) calloc(1, sizeof(Tracer));
+        if (!vm->tracer)
+        {
+            printf("ERROR: Could not allocate trace buffers\n");
+            exit(1);
+        }
+    }
+    return vm->tracer;
+}
+
+static void tracer_close(Tracer* t)
+{
+    if (t->file)
+    {
+        fclose(t->file);
+        t->file = NULL;
+    }
+    free(t->file_buffer);
+    t->file_buffer = NULL;
+}
+
+static int tracer_open(Tracer* t, const char* filename)
+{
+    t->file = fopen(filename, "wb");
+    if (!t->file)
+        return 0;
+
+    t->file_buffer = (char*) malloc(FILE_BUFFER);
+    if (t->file_buffer)
+        setvbuf(t->file, t->file_buffer, _IOFBF, FILE_BUFFER);
+
+    uint32_t magic = VMX20_TRACE_MAGIC;
+    fwrite(&magic, sizeof(magic), 1, t->file);
+    return 1;
+}
+
+// write out everything published in one ring, returns the records written
+static uint64_t ring_drain(Tracer* t, TraceRing* ring)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t count = head - tail;
+    if (count == 0)
+        return 0;
+
+    // at most two contiguous pieces, split where the ring wraps
+    uint64_t start = tail & (RING_RECORDS - 1);
+    uint64_t first = RING_RECORDS - start < count ? RING_RECORDS - start : count;
+    fwrite(&ring->records[start], sizeof(TraceRecord), first, t->file);
+    if (count > first)
+        fwrite(&ring->records[0], sizeof(TraceRecord), count - first, t->file);
+
+    atomic_store_explicit(&ring->tail, head, memory_order_release);
+    return count;
+}
+
+static void* writer_main(void* arg)
+{
+    Tracer* t = (Tracer*) arg;
+    struct timespec idle = { 0, 1000000 };
+
+    for (;;)
+    {
+        // read stop before draining, so the last pass sees every record
+        int stop = atomic_load_explicit(&t->stop, memory_order_acquire);
+
+        uint64_t written = 0;
+        for (uint32_t i = 0; i < t->num_rings; i++)
+            written += ring_drain(t, &t->rings[i]);
+
+        if (stop)
+            break;
+        if (written == 0)
+            nanosleep(&idle, NULL);
+    }
+
+    fflush(t->file);
+    return NULL;
+}
+
+void trace_begin(VM* vm)
+{
+    Tracer* t = tracer_get(vm);
+    if (!t->file && !tracer_open(t, DEFAULT_TRACE_FILE))
+    {
+        printf("ERROR: Could not open trace file %s\n", DEFAULT_TRACE_FILE);
+        exit(1);
+    }
+
+    if (t->num_rings < vm->num_procs)
+    {
+        TraceRing* rings = (TraceRing*) realloc(t->rings, sizeof(TraceRing) * vm->num_procs);
+        if (!rings)
+        {
+            printf("ERROR: Could not allocate trace buffers\n");
+            exit(1);
+        }
+        for (uint32_t i = t->num_rings; i < vm->num_procs; i++)
+        {
+            rings[i].records = (TraceRecord*) malloc(sizeof(TraceRecord) * RING_RECORDS);
+            if (!rings[i].records)
+            {
+                printf("ERROR: Could not allocate trace buffers\n");
+                exit(1);
+            }
+        }
+        t->rings = rings;
+        t->num_rings = vm->num_procs;
+    }
+
+    for (uint32_t i = 0; i < t->num_rings; i++)
+    {
+        atomic_store_explicit(&t->rings[i].head, 0, memory_order_relaxed);
+        atomic_store_explicit(&t->rings[i].tail, 0, memory_order_relaxed);
+    }
+
+    atomic_store_explicit(&t->stop, 0, memory_order_relaxed);
+    if (pthread_create(&t->writer, NULL, &writer_main, t) != 0)
+    {
+        printf("ERROR: Could not start trace writer\n");
+        exit(1);
+    }
+}
+
+void trace_end(VM* vm)
+{
+    Tracer* t = vm->tracer;
+    atomic_store_explicit(&t->stop, 1, memory_order_release);
+    pthread_join(t->writer, NULL);
+}
+
+void trace_step(VM* vm, int pid, int32_t* regs)
+{
+    TraceRing* ring = &vm->tracer->rings[pid];
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    // the ring is full, wait for the writer to catch up
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= RING_RECORDS)
+        sched_yield();
+
+    TraceRecord* rec = &ring->records[head & (RING_RECORDS - 1)];
+    rec->pid = pid;
+    rec->pc = regs[15] - 1;
+    rec->word = vm->mem[regs[15] - 1];
+    memcpy(rec->regs, regs, sizeof(rec->regs));
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void trace_destroy(VM* vm)
+{
+    Tracer* t = vm->tracer;
+    if (!t)
+        return;
+
+    tracer_close(t);
+    for (uint32_t i = 0; i < t->num_rings; i++)
+        free(t->rings[i].records);
+    free(t->rings);
+    free(t);
+    vm->tracer = NULL;
+}
+
+int32_t setTraceFile(void *handle, char *filename)
+{
+    VM* vm = (VM*) handle;
+    Tracer* t = tracer_get(vm);
+
+    tracer_close(t);
+    if (!filename)
+        return 1;
+    return tracer_open(t, filename);
+}
@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "vmx20.h"
+#include "vmx20ext.h"
+#include "vmx20priv.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// instructions a processor runs before yielding its thread when there are
+// more simulated processors than worker threads
+#define QUANTUM 10000
+
+// OS threads owned by a VM. They are started by the first execute call
+// and then sleep between calls, picking simulated processors off a run
+// queue. A processor that uses up its quantum goes to the back of the
+// queue, so any number of processors can share a few threads; one that
+// uses up its instruction budget leaves the queue until resumed.
+struct Workers {
+    VM* vm;
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // processors were queued, or shutdown was set
+    pthread_cond_t done;    // the last processor of a run finished
+    pthread_t* threads;
+    uint32_t num_threads;
+    uint32_t* queue;        // ring of runnable processor indexes
+    uint32_t cap;
+    uint32_t head;
+    uint32_t count;
+    uint32_t remaining;     // processors of the current run still going
+    int64_t quantum;
+    int shutdown;
+};
+
+static void* worker_main(void* arg)
+{
+    Workers* w = (Workers*) arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;)
+    {
+        while (!w->shutdown && w->count == 0)
+            pthread_cond_wait(&w->work, &w->lock);
+        if (w->shutdown)
+            break;
+
+        uint32_t index = w->queue[w->head];
+        w->head = (w->head + 1) % w->cap;
+        w->count--;
+        Proc* p = &w->vm->procs[index];
+        int64_t slice = w->quantum < p->budget ? w->quantum : p->budget;
+        pthread_mutex_unlock(&w->lock);
+
+        if (p->stats)
+            p->stats->queue_wait_ns += contention_now() - p->stats->queued_at;
+        int status = execute_helper(w->vm, p, slice);
+
+        // a preempted processor ran its whole slice
+        if (status == PROC_PREEMPTED && p->budget != INT64_MAX)
+        {
+            p->budget -= slice;
+            if (p->budget == 0)
+                status = VMX20_BUDGET_EXHAUSTED;
+        }
+
+        if (p->stats)
+        {
+            uint64_t start = contention_now();
+            pthread_mutex_lock(&w->lock);
+            p->stats->lock_wait_ns += contention_now() - start;
+        }
+        else
+            pthread_mutex_lock(&w->lock);
+        if (status == PROC_PREEMPTED)
+        {
+            if (p->stats)
+                p->stats->queued_at = contention_now();
+            w->queue[(w->head + w->count) % w->cap] = index;
+            w->count++;
+            pthread_cond_signal(&w->work);
+        }
+        else
+        {
+            p->status = status;
+            if (--w->remaining == 0)
+                pthread_cond_signal(&w->done);
+        }
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+static Workers* workers_create(VM* vm)
+{
+    Workers* w = (Workers*) calloc(1, sizeof(Workers));
+    if (!w)
+    {
+        printf("ERROR: Could not allocate worker threads\n");
+        exit(1);
+    }
+    w->vm = vm;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+    return w;
+}
+
+// start threads until there are num of them; w->lock is held
+static void workers_grow(VM* vm, Workers* w, uint32_t num)
+{
+    pthread_t* threads = (pthread_t*) realloc(w->threads, sizeof(pthread_t) * num);
+    if (!threads)
+    {
+        printf("ERROR: Could not allocate worker threads\n");
+        exit(1);
+    }
+    w->threads = threads;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    for (; w->num_threads < num; w->num_threads++)
+    {
+        if (pthread_create(&w->threads[w->num_threads], NULL, &worker_main, w) != 0)
+        {
+            printf("ERROR: Could not start worker thread\n");
+            exit(1);
+        }
+
+        if ((vm->worker_flags & VMX20_WORKERS_PIN) && cpus > 0)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(w->num_threads % cpus, &set);
+            pthread_setaffinity_np(w->threads[w->num_threads], sizeof(set), &set);
+        }
+    }
+}
+
+void workers_run(VM* vm)
+{
+    if (vm->num_procs == 0)
+        return;
+
+    if (!vm->workers)
+        vm->workers = workers_create(vm);
+    Workers* w = vm->workers;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->cap < vm->num_procs)
+    {
+        uint32_t* queue = (uint32_t*) realloc(w->queue, sizeof(uint32_t) * vm->num_procs);
+        if (!queue)
+        {
+            printf("ERROR: Could not allocate run queue\n");
+            exit(1);
+        }
+        w->queue = queue;
+        w->cap = vm->num_procs;
+    }
+
+    uint32_t want = vm->num_procs;
+    if (vm->max_threads > 0 && vm->max_threads < want)
+        want = vm->max_threads;
+    if (w->num_threads < want)
+        workers_grow(vm, w, want);
+
+    // with a thread for every processor there is nothing to multiplex
+    w->quantum = w->num_threads >= vm->num_procs ? INT64_MAX : QUANTUM;
+
+    // processors that stopped in an earlier run keep their status
+    w->head = 0;
+    w->count = 0;
+    for (uint32_t i = 0; i < vm->num_procs; i++)
+    {
+        if (vm->procs[i].status == PROC_PREEMPTED)
+            w->queue[w->count++] = i;
+    }
+    w->remaining = w->count;
+    pthread_cond_broadcast(&w->work);
+
+    while (w->remaining > 0)
+        pthread_cond_wait(&w->done, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void workers_destroy(VM* vm)
+{
+    Workers* w = vm->workers;
+    if (!w)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->shutdown = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    for (uint32_t i = 0; i < w->num_threads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    pthread_cond_destroy(&w->done);
+    pthread_cond_destroy(&w->work);
+    pthread_mutex_destroy(&w->lock);
+    free(w->threads);
+    free(w->queue);
+    free(w);
+    vm->workers = NULL;
+}
+
+int32_t setWorkerThreads(void *handle, uint32_t numThreads, int32_t flags)
+{
+    VM* vm = (VM*) handle;
+
+    // the next execute call starts threads with the new settings
+    workers_destroy(vm);
+    vm->max_threads = numThreads;
+    vm->worker_flags = flags;
+    return 1;
+}
+
+int32_t setInstructionBudget(void *handle, uint64_t instructions)
+{
+    VM* vm = (VM*) handle;
+    vm->budget = instructions;
+    return 1;
+}
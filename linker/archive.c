@@ -0,0 +1,66 @@
+#include "linkx20.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// Reading archives of object files, shared by linkx20 and arx20.
+
+int is_archive(const char* path)
+{
+    size_t len = strlen(path);
+    return len > 4 && strcmp(path + len - 4, ".arx") == 0;
+}
+
+int arx_sym_cmp(const void* a, const void* b)
+{
+    return strncmp(((const ArxSym*) a)->sym_name, ((const ArxSym*) b)->sym_name, 16);
+}
+
+void* arx_alloc(size_t bytes)
+{
+    void* p = calloc(bytes ? bytes : 1, 1);
+    if (!p)
+    {
+        printf("ERROR: Could not allocate %zu bytes\n", bytes);
+        exit(1);
+    }
+    return p;
+}
+
+void arx_read(int fd, void* buf, size_t bytes, long offset, const char* path)
+{
+    if (pread(fd, buf, bytes, offset) != (ssize_t) bytes)
+    {
+        printf("ERROR: Could not read %s\n", path);
+        exit(1);
+    }
+}
+
+void load_archive(Archive* ar, char* path, Arena* arena)
+{
+    ar->path = path;
+    ar->fd = open(path, O_RDONLY);
+    if (ar->fd < 0)
+    {
+        printf("ERROR: Can't open file %s\n", path);
+        exit(1);
+    }
+
+    arx_read(ar->fd, &ar->hdr, sizeof(ArxHeader), 0, path);
+    if (ar->hdr.magic != ARX_MAGIC)
+    {
+        printf("ERROR: %s is not an archive\n", path);
+        exit(1);
+    }
+    ar->members = (ArxMember*) arena_alloc(arena, sizeof(ArxMember) * ar->hdr.num_members);
+    ar->syms = (ArxSym*) arena_alloc(arena, sizeof(ArxSym) * ar->hdr.num_syms);
+    ar->pulled = (char*) arena_alloc(arena, ar->hdr.num_members);
+    arx_read(ar->fd, ar->members, sizeof(ArxMember) * ar->hdr.num_members, sizeof(ArxHeader), path);
+    arx_read(ar->fd, ar->syms, sizeof(ArxSym) * ar->hdr.num_syms,
+        sizeof(ArxHeader) + sizeof(ArxMember) * ar->hdr.num_members, path);
+}
+
+void close_archive(Archive* ar)
+{
+    close(ar->fd);
+}
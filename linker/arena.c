@@ -0,0 +1,74 @@
+#include "linkx20.h"
+
+#include <sys/mman.h>
+
+// Link arenas, shared by linkx20 and arx20. The whole reservation is mapped
+// up front without access and committed as it fills, so allocations never
+// move and fresh memory always reads as zero.
+
+// commit at least this much at a time, so growing costs few system calls
+#define ARENA_COMMIT ((size_t) 1 << 20)
+
+void arena_init(Arena* arena, size_t size)
+{
+    arena->base = (char*) mmap(NULL, ARENA_RESERVE, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (arena->base == MAP_FAILED)
+    {
+        printf("ERROR: Could not allocate %zu bytes\n", size);
+        exit(1);
+    }
+    atomic_init(&arena->size, 0);
+    atomic_init(&arena->used, 0);
+    arena_reserve(arena, size);
+}
+
+void arena_reserve(Arena* arena, size_t size)
+{
+    size_t committed = atomic_load(&arena->size);
+    if (size <= committed)
+        return;
+    if (size > ARENA_RESERVE)
+    {
+        printf("ERROR: Link arena of %zu bytes is too small\n", (size_t) ARENA_RESERVE);
+        exit(1);
+    }
+
+    // threads racing to commit overlapping ranges is harmless
+    size_t want = size > committed * 2 ? size : committed * 2;
+    want = (want + ARENA_COMMIT - 1) / ARENA_COMMIT * ARENA_COMMIT;
+    if (want > ARENA_RESERVE)
+        want = ARENA_RESERVE;
+    if (mprotect(arena->base + committed, want - committed, PROT_READ | PROT_WRITE) != 0)
+    {
+        printf("ERROR: Could not allocate %zu bytes\n", want - committed);
+        exit(1);
+    }
+    while (committed < want && !atomic_compare_exchange_weak(&arena->size, &committed, want))
+        ;
+}
+
+void* arena_alloc(Arena* arena, size_t bytes)
+{
+    bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    size_t at = atomic_fetch_add(&arena->used, bytes);
+    arena_reserve(arena, at + bytes);
+    return arena->base + at;
+}
+
+void arena_rewind(Arena* arena, size_t mark)
+{
+    size_t used = atomic_load(&arena->used);
+    if (used > mark)
+        memset(arena->base + mark, 0, used - mark);
+    atomic_store(&arena->used, mark);
+}
+
+void arena_free(Arena* arena)
+{
+    if (arena->base)
+        munmap(arena->base, ARENA_RESERVE);
+    arena->base = NULL;
+    atomic_store(&arena->size, 0);
+    atomic_store(&arena->used, 0);
+}
@@ -0,0 +1,146 @@
+#include "linkx20.h"
+
+// Build an archive of object files for linkx20, or list one. Only the
+// members a link needs are taken from an archive, found through the symbol
+// index stored in front of the members.
+
+// read a whole object file, checking that its sections add up to its size
+static char* read_object(const char* path, ArxMember* member)
+{
+    FILE* file = fopen(path, "r");
+    if (!file)
+    {
+        printf("ERROR: Can't open file %s\n", path);
+        exit(1);
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* data = (char*) arx_alloc(size);
+    if (size < (long) sizeof(Header) || fread(data, 1, size, file) != (size_t) size)
+    {
+        printf("ERROR: Could not read %s\n", path);
+        exit(1);
+    }
+    fclose(file);
+
+    memcpy(&member->hdr, data, sizeof(Header));
+    long expect = sizeof(Header) + (member->hdr.insym_size / 5 + member->hdr.outsym_size / 5) *
+        sizeof(Sym) + sizeof(word_t) * (long) member->hdr.code_size;
+    if (expect != size)
+    {
+        printf("ERROR: %s is not an object file\n", path);
+        exit(1);
+    }
+
+    const char* slash = strrchr(path, '/');
+    strncpy(member->name, slash ? slash + 1 : path, sizeof(member->name));
+    member->size = size;
+    return data;
+}
+
+static void create_archive(char* out_name, int num_members, char** in_names)
+{
+    ArxHeader head;
+    memset(&head, 0, sizeof(head));
+    head.magic = ARX_MAGIC;
+    head.num_members = num_members;
+
+    ArxMember* members = (ArxMember*) arx_alloc(sizeof(ArxMember) * num_members);
+    char** data = (char**) arx_alloc(sizeof(char*) * num_members);
+    for (int i = 0; i < num_members; i++)
+    {
+        data[i] = read_object(in_names[i], &members[i]);
+        head.num_syms += members[i].hdr.insym_size / 5;
+    }
+
+    // index every insymbol, sorted so the linker can binary search it
+    ArxSym* syms = (ArxSym*) arx_alloc(sizeof(ArxSym) * head.num_syms);
+    int at = 0;
+    for (int i = 0; i < num_members; i++)
+    {
+        Sym* insyms = (Sym*) (data[i] + sizeof(Header));
+        for (int j = 0; j < members[i].hdr.insym_size / 5; j++)
+        {
+            memcpy(syms[at].sym_name, insyms[j].sym_name, 16);
+            syms[at++].member = i;
+        }
+    }
+    qsort(syms, head.num_syms, sizeof(ArxSym), arx_sym_cmp);
+    for (uint32_t k = 1; k < head.num_syms; k++)
+    {
+        if (arx_sym_cmp(&syms[k - 1], &syms[k]) == 0)
+        {
+            printf("ERROR: Duplicate insymbol definition %.16s\n", syms[k].sym_name);
+            exit(1);
+        }
+    }
+
+    uint32_t offset = sizeof(ArxHeader) + sizeof(ArxMember) * num_members +
+        sizeof(ArxSym) * head.num_syms;
+    for (int i = 0; i < num_members; i++)
+    {
+        members[i].offset = offset;
+        offset += members[i].size;
+    }
+
+    FILE* file = fopen(out_name, "w");
+    if (!file)
+    {
+        printf("ERROR: Could not make output file %s\n", out_name);
+        exit(1);
+    }
+    int ok = fwrite(&head, sizeof(head), 1, file) == 1 &&
+        fwrite(members, sizeof(ArxMember), num_members, file) == (size_t) num_members &&
+        fwrite(syms, sizeof(ArxSym), head.num_syms, file) == head.num_syms;
+    for (int i = 0; i < num_members && ok; i++)
+        ok = fwrite(data[i], 1, members[i].size, file) == members[i].size;
+    if (!ok || fclose(file) != 0)
+    {
+        printf("ERROR: Could not write %s\n", out_name);
+        exit(1);
+    }
+
+    for (int i = 0; i < num_members; i++)
+        free(data[i]);
+    free(data);
+    free(members);
+    free(syms);
+}
+
+static void list_archive(char* path)
+{
+    Arena arena;
+    arena_init(&arena, 0);
+    Archive ar;
+    load_archive(&ar, path, &arena);
+    for (uint32_t m = 0; m < ar.hdr.num_members; m++)
+    {
+        printf("%.16s %u words\n", ar.members[m].name, ar.members[m].hdr.code_size);
+        for (uint32_t k = 0; k < ar.hdr.num_syms; k++)
+        {
+            if (ar.syms[k].member == m)
+                printf("    %.16s\n", ar.syms[k].sym_name);
+        }
+    }
+    close_archive(&ar);
+    arena_free(&arena);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "-t") == 0)
+    {
+        list_archive(argv[2]);
+        return 0;
+    }
+
+    if (argc < 3 || !is_archive(argv[1]))
+    {
+        printf("ERROR: Usage ./arx20 <archive.arx> <file1>...<fileN> | ./arx20 -t <archive.arx>\n");
+        exit(1);
+    }
+    create_archive(argv[1], argc - 2, argv + 2);
+    return 0;
+}
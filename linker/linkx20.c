@@ -1,59 +1,87 @@
 #include "linkx20.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// everything a link allocates, freed at once by clean_up
+Arena arena;
 Header* hdrs;
 Sym** insyms;
 Sym** outsyms;
-word_t** codes;
+// the file each module is read from and where in it the module starts,
+// which is past 0 only for archive members
+char** paths;
+long* file_offsets;
+// where each input's code section starts, so it can be streamed to the output later
+long* code_offsets;
+// global address of each module's first word; bases[num_files] is the total code size
+word_t* bases;
+// resolved outsymbol references of each module
+Fixup** fixups;
+int* num_fixups;
+// merged insymbols, and where each module's insymbols start in them
+Sym* exe_insyms;
+int* insym_starts;
+SymTable table;
+atomic_int found_dup;
+// output file and the offset of the code section in it
+int out_fd;
+long out_code_offset;
+word_t max_code_size;
+// code buffer of each thread writing modules
+_Thread_local word_t* scratch;
+int tot_in;
+int tot_out;
+// incremental links: each input's identity when it was read, which inputs
+// changed since the last link, and the fixups that link applied
+FileStamp* stamps;
+char* changed;
+Fixup** old_fixups;
+int* old_num_fixups;
+atomic_int relayout;
+
+int num_threads;
+// format of the output, and the metadata of a version 2 one
+int exe_version = 1;
+word_t memory_words;
+word_t stack_words;
 
 int resolved = 0;
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2) 
+    // -i keeps a state file next to the output and relinks from it; -g
+    // leaves out the modules mainx20 can't reach; -2 writes the version 2
+    // format, whose required memory and stack size -m and -s give in words
+    int incremental = 0;
+    int gc = 0;
+    for (; argc > 1; argv++, argc--)
     {
-        printf("ERROR: Usage ./linkx20 <file1>...<fileN>\n");
-        exit(1);
-    }
-
-    // allocate memory 
-    hdrs = (Header*) malloc(sizeof(Header) * (argc - 1));
-    insyms = (Sym**) malloc(sizeof(Sym*) * (argc - 1));
-    outsyms = (Sym**) malloc(sizeof(Sym*) * (argc - 1));
-    codes = (word_t**) malloc(sizeof(word_t*) * (argc - 1));
-
-    bool has_main = false;
-
-    // read all files
-    for (int i = 1; i < argc; i++)
-    {
-        if (strcmp(argv[i], "-o") == 0)
-            break;
-        FILE* file;
-        file = fopen(argv[i], "r");
-        if (!file)
+        if (strcmp(argv[1], "-i") == 0)
+            incremental = 1;
+        else if (strcmp(argv[1], "-g") == 0)
+            gc = 1;
+        else if (strcmp(argv[1], "-2") == 0)
+            exe_version = 2;
+        else if ((strcmp(argv[1], "-m") == 0 || strcmp(argv[1], "-s") == 0) && argc > 2)
         {
-            printf("ERROR: Can't open file %s\n", argv[i]);
-            exit(1);
+            word_t words = (word_t) strtoul(argv[2], NULL, 10);
+            if (argv[1][1] == 'm')
+                memory_words = words;
+            else
+                stack_words = words;
+            argv++;
+            argc--;
         }
-
-        hdrs[i - 1] = read_header(file);
-        insyms[i - 1] = (Sym*) malloc(sizeof(Sym) * (hdrs[i - 1].insym_size / 5));
-        outsyms[i - 1] = (Sym*) malloc(sizeof(Sym) * (hdrs[i - 1].outsym_size / 5));
-        read_syms(insyms[i - 1], hdrs[i - 1].insym_size / 5, file);
-        read_syms(outsyms[i - 1], hdrs[i - 1].outsym_size / 5, file);
-        codes[i - 1] = (word_t*) malloc(sizeof(Sym) * hdrs[i - 1].code_size);
-        read_code(codes[i - 1], hdrs[i - 1].code_size, file);
-
-        fclose(file);
-
-        // error checking
-        if (check_mainx20(insyms[i - 1], hdrs[i - 1]))
-            has_main = true;
+        else
+            break;
     }
 
-    if (!has_main)
+    if (argc < 2) 
     {
-        printf("ERROR: Could not find main function\n");
+        printf("ERROR: Usage ./linkx20 [-i] [-g] [-2 [-m words] [-s words]] <file1>...<fileN>\n");
         exit(1);
     }
 
@@ -78,44 +106,343 @@ int main(int argc, char* argv[])
         num_files = argc - 1;
     }
     strcat(out_name, ".exe");
-    
-    // get code into one array
-    word_t* exe_code = get_code(num_files);
-
-    int in_size = 0;
-    int tot_out = 0;
-    int tot_in = 0;
-    // get all insyms into one array
+
+    // inputs are mostly waiting on I/O, so use more threads than cores
+    num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_threads < LINK_MIN_THREADS)
+        num_threads = LINK_MIN_THREADS;
+    arena_init(&arena, 0);
+    start_workers(num_threads - 1);
+
+    // archives only contribute the members the other inputs need, and -g
+    // only the modules mainx20 reaches; what they contribute can change with
+    // any input, so -i links them in full, as it does v2 outputs whose index
+    // covers every symbol
+    int archives = 0;
+    for (int i = 0; i < num_files; i++)
+        archives |= is_archive(argv[i + 1]);
+    if (gc || exe_version == 2)
+        incremental = 0;
+    if (archives)
+    {
+        incremental = 0;
+        num_files = select_members(num_files, argv + 1);
+    }
+    else
+    {
+        alloc_inputs(num_files);
+        memcpy(paths, argv + 1, sizeof(char*) * num_files);
+    }
+
+    char state_name[40];
+    snprintf(state_name, sizeof(state_name), "%s.state", out_name);
+    if (incremental && relink(state_name, out_name, num_files))
+    {
+        stop_workers();
+        clean_up();
+        return 0;
+    }
+    // a state left from an earlier link no longer describes the output
+    unlink(state_name);
+
+    // read the headers first; their sizes give the size of everything else
+    hdrs = (Header*) arena_alloc(&arena, sizeof(Header) * num_files);
+    parallel_for(num_files, read_input_header);
+    alloc_link(num_files, gc ? (sizeof(int) + sizeof(char)) * num_files + ARENA_ALIGN * 2 : 0);
+
+    // read all files
+    parallel_for(num_files, read_input);
+
+    resolve_link(num_files);
+    if (gc)
+        drop_dead_modules(num_files);
+    create_file(out_name, exe_insyms, tot_in, num_files);
+    if (incremental)
+        save_state(state_name, out_name, num_files);
+    stop_workers();
+    clean_up();
+}
+
+void alloc_inputs(int num_files)
+{
+    paths = (char**) arena_alloc(&arena, sizeof(char*) * num_files);
+    file_offsets = (long*) arena_alloc(&arena, sizeof(long) * num_files);
+}
+
+void alloc_link(int num_files, size_t extra)
+{
+    tot_out = 0;
+    tot_in = 0;
+    max_code_size = 0;
     for (int i = 0; i < num_files; i++)
     {
-        in_size += hdrs[i].insym_size;
         tot_out += hdrs[i].outsym_size / 5;
         tot_in += hdrs[i].insym_size / 5;
+        if (hdrs[i].code_size > max_code_size)
+            max_code_size = hdrs[i].code_size;
     }
-        
-    Sym* exe_insyms = (Sym*) malloc(sizeof(Sym) * in_size);
-    adjust_insym_addr(num_files, exe_insyms);
-    for (int i = 0; i < tot_in; i++)
+
+    // one slack alignment per allocation, committed at once ahead of the
+    // parallel phases
+    size_t size = (sizeof(Sym*) * 2 + sizeof(Fixup*) * 2 + sizeof(long) + sizeof(word_t) +
+            sizeof(int) * 3 + sizeof(FileStamp) + sizeof(char)) * num_files
+        + sizeof(word_t) + sizeof(Sym) * (tot_in + tot_out) + sizeof(Fixup) * tot_out
+        + symtab_bytes(tot_in) + sizeof(word_t) * max_code_size * num_threads
+        + extra + ARENA_ALIGN * (24 + num_threads);
+    arena_reserve(&arena, atomic_load(&arena.used) + size);
+
+    insyms = (Sym**) arena_alloc(&arena, sizeof(Sym*) * num_files);
+    outsyms = (Sym**) arena_alloc(&arena, sizeof(Sym*) * num_files);
+    code_offsets = (long*) arena_alloc(&arena, sizeof(long) * num_files);
+    insym_starts = (int*) arena_alloc(&arena, sizeof(int) * num_files);
+    fixups = (Fixup**) arena_alloc(&arena, sizeof(Fixup*) * num_files);
+    num_fixups = (int*) arena_alloc(&arena, sizeof(int) * num_files);
+    stamps = (FileStamp*) arena_alloc(&arena, sizeof(FileStamp) * num_files);
+    changed = (char*) arena_alloc(&arena, sizeof(char) * num_files);
+    old_fixups = (Fixup**) arena_alloc(&arena, sizeof(Fixup*) * num_files);
+    old_num_fixups = (int*) arena_alloc(&arena, sizeof(int) * num_files);
+    bases = (word_t*) arena_alloc(&arena, sizeof(word_t) * (num_files + 1));
+
+    // each kind of symbol sits in one array, module after module; insymbols
+    // are moved to their global addresses in place, becoming the output's
+    exe_insyms = (Sym*) arena_alloc(&arena, sizeof(Sym) * tot_in);
+    Sym* all_outsyms = (Sym*) arena_alloc(&arena, sizeof(Sym) * tot_out);
+    Fixup* all_fixups = (Fixup*) arena_alloc(&arena, sizeof(Fixup) * tot_out);
+    int in_at = 0;
+    int out_at = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        insym_starts[i] = in_at;
+        insyms[i] = &exe_insyms[in_at];
+        outsyms[i] = &all_outsyms[out_at];
+        fixups[i] = &all_fixups[out_at];
+        code_offsets[i] = file_offsets[i] + sizeof(Header) + hdrs[i].insym_size / 5 * sizeof(Sym) +
+            hdrs[i].outsym_size / 5 * sizeof(Sym);
+        in_at += hdrs[i].insym_size / 5;
+        out_at += hdrs[i].outsym_size / 5;
+    }
+    symtab_init(&table, tot_in, &arena);
+}
+
+void drop_dead_modules(int num_files)
+{
+    // the entry point is the first word of the first module, and mainx20
+    // must stay findable, so their modules are the roots
+    char* live = (char*) arena_alloc(&arena, sizeof(char) * num_files);
+    int* stack = (int*) arena_alloc(&arena, sizeof(int) * num_files);
+    int top = 0;
+    int main_file = symtab_find(&table, "mainx20")->file;
+    live[0] = 1;
+    stack[top++] = 0;
+    if (!live[main_file])
     {
-        for (int j = 0; j < tot_in; j++)
+        live[main_file] = 1;
+        stack[top++] = main_file;
+    }
+
+    while (top > 0)
+    {
+        int i = stack[--top];
+        for (int k = 0; k < hdrs[i].outsym_size / 5; k++)
         {
-            if (j != i && strcmp(exe_insyms[i].sym_name, exe_insyms[j].sym_name) == 0)
+            SymEntry* entry = symtab_find(&table, outsyms[i][k].sym_name);
+            if (entry && !live[entry->file])
             {
-                printf("ERROR: Duplicate insymbol definition %s\n", exe_insyms[i].sym_name);
-                exit(0);
+                live[entry->file] = 1;
+                stack[top++] = entry->file;
             }
         }
     }
 
-    int ressed = res_syms(exe_code, exe_insyms, num_files, tot_in);
+    // dead modules become empty, so placing, indexing and writing the
+    // output pass over them; live insymbols move back to module addresses
+    // and down over the dead ones
+    int in_at = 0;
+    tot_out = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        if (!live[i])
+            memset(&hdrs[i], 0, sizeof(Header));
+        int count = hdrs[i].insym_size / 5;
+        for (int j = 0; j < count; j++)
+            insyms[i][j].addr -= bases[i];
+        memmove(&exe_insyms[in_at], insyms[i], sizeof(Sym) * count);
+        insyms[i] = &exe_insyms[in_at];
+        insym_starts[i] = in_at;
+        in_at += count;
+        tot_out += hdrs[i].outsym_size / 5;
+        num_fixups[i] = 0;
+    }
+    tot_in = in_at;
+
+    resolve_link(num_files);
+}
+
+void resolve_link(int num_files)
+{
+    compute_bases(num_files);
+    parallel_for(num_files, adjust_insym_addr);
+
+    // index every insymbol once; a name already present is a duplicate
+    memset(table.entries, 0, sizeof(SymEntry) * table.cap);
+    parallel_for(num_files, index_insyms);
+
+    if (!symtab_find(&table, "mainx20"))
+    {
+        printf("ERROR: Could not find main function\n");
+        exit(1);
+    }
+
+    if (atomic_load(&found_dup))
+    {
+        Sym* dup = first_dup(tot_in);
+        printf("ERROR: Duplicate insymbol definition %s\n", dup->sym_name);
+        exit(0);
+    }
+
+    parallel_for(num_files, res_syms);
+    int ressed = 0;
+    for (int i = 0; i < num_files; i++)
+        ressed += num_fixups[i];
     if (tot_out > ressed)
     {
         printf("ERROR: Could not resolve all outsymbols\n");
         exit(1);
     }
+}
+
+// Threads started once by start_workers that run every parallel_for of the
+// link. Each call posts one job; the workers and the calling thread take its
+// indexes until none are left, and the call returns when all workers are
+// done with it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work;    // a job was posted, or shutdown was set
+    pthread_cond_t done;    // the last worker finished the job
+    pthread_t* threads;
+    int num_workers;
+    void (*fn)(int);
+    int count;
+    atomic_int next;
+    unsigned job;           // bumped for every job posted
+    int busy;               // workers still taking indexes of the job
+    int shutdown;
+} WorkerPool;
+
+static WorkerPool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+// run the posted job's fn on indexes until none are left
+static void take_indexes()
+{
+    int i;
+    while ((i = atomic_fetch_add(&pool.next, 1)) < pool.count)
+        pool.fn(i);
+}
+
+static void* pool_worker(void* arg)
+{
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (!pool.shutdown && pool.job == seen)
+            pthread_cond_wait(&pool.work, &pool.lock);
+        if (pool.shutdown)
+            break;
+        seen = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        take_indexes();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void start_workers(int count)
+{
+    pool.threads = (pthread_t*) arena_alloc(&arena, sizeof(pthread_t) * count);
+    for (; pool.num_workers < count; pool.num_workers++)
+    {
+        if (pthread_create(&pool.threads[pool.num_workers], NULL, &pool_worker, NULL) != 0)
+        {
+            printf("ERROR: Could not start thread\n");
+            exit(1);
+        }
+    }
+}
+
+void stop_workers()
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.shutdown = 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int t = 0; t < pool.num_workers; t++)
+        pthread_join(pool.threads[t], NULL);
+    pool.threads = NULL;
+    pool.num_workers = 0;
+}
+
+void parallel_for(int count, void (*fn)(int))
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.count = count;
+    atomic_store(&pool.next, 0);
+    pool.busy = pool.num_workers;
+    pool.job++;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+
+    // the calling thread takes a share too
+    take_indexes();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void read_input_header(int i)
+{
+    FILE* file;
+    file = fopen(paths[i], "r");
+    if (!file || fseek(file, file_offsets[i], SEEK_SET) != 0)
+    {
+        printf("ERROR: Can't open file %s\n", paths[i]);
+        exit(1);
+    }
 
-    create_file(out_name, exe_code, exe_insyms, tot_in, num_files);
-    free(exe_insyms);
+    hdrs[i] = read_header(file);
+    fclose(file);
+}
+
+void read_input(int i)
+{
+    FILE* file;
+    file = fopen(paths[i], "r");
+    if (!file || fseek(file, file_offsets[i] + sizeof(Header), SEEK_SET) != 0)
+    {
+        printf("ERROR: Can't open file %s\n", paths[i]);
+        exit(1);
+    }
+
+    read_syms(insyms[i], hdrs[i].insym_size / 5, file);
+    read_syms(outsyms[i], hdrs[i].outsym_size / 5, file);
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0)
+        stamps[i] = stamp_of(&st);
+
+    fclose(file);
 }
 
 Header read_header(FILE *file)
@@ -148,135 +475,169 @@ void read_code(word_t* code, int code_size, FILE* file)
     }
 }
 
-bool check_mainx20(Sym* syms, Header hdr)
+void compute_bases(int num_files)
 {
-    for (int i = 0; i < hdr.insym_size / 5; i++)
+    bases[0] = 0;
+    for (int i = 0; i < num_files; i++)
+        bases[i + 1] = bases[i] + hdrs[i].code_size;
+}
+
+void adjust_insym_addr(int i)
+{
+    for (int j = 0; j < hdrs[i].insym_size / 5; j++)
+        insyms[i][j].addr += bases[i];
+}
+
+void index_insyms(int i)
+{
+    Sym* syms = &exe_insyms[insym_starts[i]];
+    for (int j = 0; j < hdrs[i].insym_size / 5; j++)
     {
-        if (strcmp(syms[i].sym_name, "mainx20") == 0)
-            return true;
+        if (symtab_insert(&table, &syms[j], i))
+            atomic_store(&found_dup, 1);
     }
+}
 
-    return false;
+Sym* first_dup(int tot_in)
+{
+    // which of the racing definitions got in first is arbitrary, so find
+    // the first insymbol in file order whose name is defined more than once,
+    // the one a serial link reports
+    SymTable names;
+    symtab_init(&names, tot_in, &arena);
+    for (int i = 0; i < tot_in; i++)
+    {
+        // file -1 marks a name seen twice
+        SymEntry* prev = symtab_insert(&names, &exe_insyms[i], 0);
+        if (prev)
+            prev->file = -1;
+    }
+    Sym* dup = NULL;
+    for (int i = 0; i < tot_in && !dup; i++)
+    {
+        if (symtab_find(&names, exe_insyms[i].sym_name)->file == -1)
+            dup = &exe_insyms[i];
+    }
+    return dup;
 }
 
-int get_code_size(int num_files)
+void res_syms(int i)
 {
-    int size = 0;
-    for (int i = 0; i < num_files; i++)
-        size += hdrs[i].code_size;
+    // iterate outsymbols
+    for (int k = 0; k < hdrs[i].outsym_size / 5; k++)
+    {
+        Sym out = outsyms[i][k];
+        SymEntry* entry = symtab_find(&table, out.sym_name);
+        // only definitions from other files resolve an outsymbol
+        if (!entry || entry->file == i)
+            continue;
 
-    return size;
+        Fixup* fix = &fixups[i][num_fixups[i]++];
+        fix->index = bases[i] + out.addr;
+        fix->target = entry->sym->addr;
+    }
 }
 
-word_t* get_code(int num_files)
+void apply_fixups(word_t* code, int file)
 {
-    static word_t code[10000];
-    int index = 0;
-
-    for (int i = 0; i < num_files; i++)
+    for (int k = 0; k < num_fixups[file]; k++)
     {
-        for (int j = 0; j < hdrs[i].code_size; j++)
+        int index = fixups[file][k].index;
+        word_t* word = &code[index - bases[file]];
+        int args = get_args(*word & 0x000000FF);
+        if (args == 0 || args == 2)
+        {
+            int addr = ((*word >> 12) | fixups[file][k].target);
+            addr -= (index + 1);
+            *word |= (addr << 12);
+        }
+        else if (args == 1)
+        {
+            int addr = ((*word >> 16) | fixups[file][k].target);
+            addr -= (index - 1);
+            *word |= (addr << 16);
+        }
+        else 
         {
-            code[index] = codes[i][j];
-            index++;
+            printf("ERROR: Code does not have an address");
+            exit(1);
         }
     }
-
-    return code;
 }
 
-void adjust_insym_addr(int num_files, Sym* exe_insyms)
+// FNV-1a over the (at most 16 byte) symbol name
+static unsigned int sym_hash(const char* name)
 {
-    int index = 0;
-    for (int i = 0; i < num_files; i++)
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < 16 && name[i]; i++)
     {
-        for (int j = 0; j < hdrs[i].insym_size / 5; j++)
-        {
-            exe_insyms[index] = insyms[i][j];
-            int offset = get_code_size(i) + insyms[i][j].addr;
-            if (i != 0)
-                exe_insyms[index].addr += offset;
-            index++;
-        }
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-int res_syms(word_t* code, Sym* exe_insyms, int num_files, int tot_in)
+static int symtab_cap(int num_syms)
 {
-    int matches = 0;
-    // first two loops check each file against each other
-    for (int i = 0; i < num_files; i++)
+    // keep the load factor at or below one half
+    int cap = 16;
+    while (cap < num_syms * 2)
+        cap *= 2;
+    return cap;
+}
+
+size_t symtab_bytes(int num_syms)
+{
+    return sizeof(SymEntry) * symtab_cap(num_syms);
+}
+
+void symtab_init(SymTable* table, int num_syms, Arena* arena)
+{
+    table->cap = symtab_cap(num_syms);
+    table->entries = (SymEntry*) arena_alloc(arena, symtab_bytes(num_syms));
+}
+
+SymEntry* symtab_insert(SymTable* table, Sym* sym, int file)
+{
+    unsigned int i = sym_hash(sym->sym_name) & (table->cap - 1);
+    for (;;)
     {
-        for (int j = 0; j < num_files; j++)
-        {
-            if (i != j)
-            {
-                // iterate outsymbols
-                for (int k = 0; k < hdrs[i].outsym_size / 5; k++)
-                {
-                    // iterate insymbols
-                    for (int h = 0; h < hdrs[j].insym_size / 5; h++)
-                    {
-                        Sym out = outsyms[i][k];
-                        Sym in = insyms[j][h];
-                        // found a match
-                        if (strcmp(out.sym_name, in.sym_name) == 0)
-                        {
-                            int index = get_code_size(i) + out.addr;
-                            int args = get_args(code[index] & 0x000000FF);
-                            Sym insym = get_exe_insym(in.sym_name, exe_insyms, tot_in);
-                            if (insym.sym_name[0] == '\0')
-                            {
-                                printf("ERROR: Cannot find insym\n");
-                                exit(1);
-                            }
-                            if (args == 0 || args == 2)
-                            {
-                                int addr = ((code[index] >> 12) | insym.addr);
-                                addr -= (index + 1);
-                                code[index] |= (addr << 12);
-                            }
-                            else if (args == 1)
-                            {
-                                int addr = ((code[index] >> 16) | insym.addr);
-                                addr -= (index - 1);
-                                code[index] |= (addr << 16);
-                            }
-                            else 
-                            {
-                                printf("ERROR: Code does not have an address");
-                                exit(1);
-                            }
-
-                            matches++;
-                        }
-                    }
-                }
-            }
-        }
+        // claim an empty slot, or compare against whoever claimed it first
+        Sym* cur = NULL;
+        if (atomic_compare_exchange_strong(&table->entries[i].sym, &cur, sym))
+            break;
+        if (strncmp(cur->sym_name, sym->sym_name, 16) == 0)
+            return &table->entries[i];
+        i = (i + 1) & (table->cap - 1);
     }
-    return matches;
+
+    table->entries[i].file = file;
+    return NULL;
 }
 
-Sym get_exe_insym(char* insym_name, Sym* exe_insyms, int tot_in)
+SymEntry* symtab_find(SymTable* table, const char* name)
 {
-    for (int i = 0; i < tot_in; i++)
+    unsigned int i = sym_hash(name) & (table->cap - 1);
+    while (table->entries[i].sym)
     {
-        if (strcmp(exe_insyms[i].sym_name, insym_name) == 0)
-            return exe_insyms[i];
+        if (strncmp(table->entries[i].sym->sym_name, name, 16) == 0)
+            return &table->entries[i];
+        i = (i + 1) & (table->cap - 1);
     }
-    Sym temp;
-    temp.sym_name[0] = '\0';
-    temp.addr = -1;
-    return temp;
+
+    return NULL;
 }
 
-void create_file(char* file_name, word_t* code, Sym* insyms, int tot_in, int num_files)
+void create_file(char* file_name, Sym* insyms, int tot_in, int num_files)
 {
-    word_t* header = (word_t*) malloc(sizeof(word_t) * 3);
-    header[0] = tot_in * 5;
+    // a v2 output pads the insymbols with unnamed ones up to a page boundary
+    int pad = 0;
+    word_t header[3];
+    while (exe_version == 2 && (sizeof(header) + sizeof(Sym) * (tot_in + pad)) % EXE_PAGE)
+        pad++;
+    header[0] = (tot_in + pad) * 5;
     header[1] = 0;
-    header[2] = get_code_size(num_files);
+    header[2] = bases[num_files];
 
     FILE* file;
     file = fopen(file_name, "w");
@@ -294,22 +655,185 @@ void create_file(char* file_name, word_t* code, Sym* insyms, int tot_in, int num
     }
 
     // write insymbols
-    if (fwrite(insyms, sizeof(Sym), tot_in, file) != tot_in)
+    Sym blank;
+    memset(&blank, 0, sizeof(blank));
+    int ok = fwrite(insyms, sizeof(Sym), tot_in, file) == tot_in;
+    for (int i = 0; i < pad && ok; i++)
+        ok = fwrite(&blank, sizeof(Sym), 1, file) == 1;
+    if (!ok)
     {
         printf("ERROR: Could not write insymbols\n");
         exit(1);
     }
 
-    // write code
-    int code_size = get_code_size(num_files);
-    if (fwrite(code, sizeof(word_t), code_size, file) != code_size)
+    // modules are patched and written at their own offsets in parallel
+    fflush(file);
+    out_fd = fileno(file);
+    out_code_offset = sizeof(header) + sizeof(Sym) * (tot_in + pad);
+    parallel_for(num_files, write_module);
+    if (exe_version == 2)
+        write_trailer(out_fd, out_code_offset + sizeof(word_t) * bases[num_files], insyms, tot_in,
+            bases[num_files]);
+
+    fclose(file);
+}
+
+uint32_t exe_hash(const char* name, uint32_t seed)
+{
+    // FNV-1a over the name, then a finalizer so that seeds spread well
+    uint32_t hash = 2166136261u ^ seed;
+    for (int i = 0; i < 16 && name[i]; i++)
     {
-        printf("ERROR: Could not write code\n");
+        hash ^= (unsigned char) name[i];
+        hash *= 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bu;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35u;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// seeds tried per bucket before the index is rebuilt with more slots
+#define INDEX_MAX_SEED 65536
+
+// place the names of bucket b, members[0..count), with the first seed that
+// hashes them all to free and distinct slots; at holds count slots
+static int place_bucket(Sym* syms, int* members, int count, uint32_t* seed_of, int32_t* slots,
+    uint32_t num_slots, uint32_t* at)
+{
+    int placed = 0;
+    for (uint32_t seed = 1; seed < INDEX_MAX_SEED && !placed; seed++)
+    {
+        int k = 0;
+        for (; k < count; k++)
+        {
+            at[k] = exe_hash(syms[members[k]].sym_name, seed) & (num_slots - 1);
+            int clash = slots[at[k]] >= 0;
+            for (int q = 0; q < k && !clash; q++)
+                clash = at[q] == at[k];
+            if (clash)
+                break;
+        }
+        if (k < count)
+            continue;
+
+        for (k = 0; k < count; k++)
+            slots[at[k]] = members[k];
+        *seed_of = seed;
+        placed = 1;
+    }
+    return placed;
+}
+
+void build_index(Sym* syms, int num_syms, ExeTrailer* trailer, uint32_t** seeds, int32_t** slots)
+{
+    uint32_t num_buckets = num_syms / 4 + 1;
+    uint32_t num_slots = 1;
+    while (num_slots < (uint32_t) (num_syms + num_syms / 4 + 1))
+        num_slots *= 2;
+
+    // the names of each bucket, bucket after bucket
+    int* starts = (int*) arena_alloc(&arena, sizeof(int) * (num_buckets + 1));
+    int* members = (int*) arena_alloc(&arena, sizeof(int) * num_syms);
+    int max_count = 0;
+    for (int j = 0; j < num_syms; j++)
+        starts[exe_hash(syms[j].sym_name, 0) % num_buckets + 1]++;
+    for (uint32_t b = 0; b < num_buckets; b++)
+    {
+        if (starts[b + 1] > max_count)
+            max_count = starts[b + 1];
+        starts[b + 1] += starts[b];
+    }
+    int* fill = (int*) arena_alloc(&arena, sizeof(int) * num_buckets);
+    for (int j = 0; j < num_syms; j++)
+    {
+        uint32_t b = exe_hash(syms[j].sym_name, 0) % num_buckets;
+        members[starts[b] + fill[b]++] = j;
+    }
+    uint32_t* at = (uint32_t*) arena_alloc(&arena, sizeof(uint32_t) * max_count);
+
+    // fullest buckets first, while most slots are still free; a failed try
+    // leaves its tables in the arena, at most as much again as the last
+    for (;;)
+    {
+        *seeds = (uint32_t*) arena_alloc(&arena, sizeof(uint32_t) * num_buckets);
+        *slots = (int32_t*) arena_alloc(&arena, sizeof(int32_t) * num_slots);
+        memset(*slots, 0xff, sizeof(int32_t) * num_slots);
+        int ok = 1;
+        for (int count = max_count; count > 0 && ok; count--)
+        {
+            for (uint32_t b = 0; b < num_buckets && ok; b++)
+            {
+                if (starts[b + 1] - starts[b] == count)
+                    ok = place_bucket(syms, &members[starts[b]], count, &(*seeds)[b], *slots,
+                        num_slots, at);
+            }
+        }
+        if (ok)
+            break;
+        num_slots *= 2;
+    }
+
+    trailer->index_buckets = num_buckets;
+    trailer->index_slots = num_slots;
+}
+
+void write_trailer(int fd, long offset, Sym* syms, int num_syms, word_t code_size)
+{
+    ExeTrailer trailer;
+    memset(&trailer, 0, sizeof(trailer));
+    trailer.magic = EXE2_MAGIC;
+    trailer.version = 2;
+    trailer.num_syms = num_syms;
+    // the first module is placed at address 0
+    trailer.entry = 0;
+    // at least the code and the word past its end
+    trailer.memory_words = memory_words > code_size + 1 ? memory_words : code_size + 1;
+    trailer.stack_words = stack_words;
+    trailer.index_offset = offset;
+
+    uint32_t* seeds;
+    int32_t* slots;
+    build_index(syms, num_syms, &trailer, &seeds, &slots);
+    size_t seed_bytes = sizeof(uint32_t) * trailer.index_buckets;
+    size_t slot_bytes = sizeof(int32_t) * trailer.index_slots;
+    if (pwrite(fd, seeds, seed_bytes, offset) != (ssize_t) seed_bytes ||
+        pwrite(fd, slots, slot_bytes, offset + seed_bytes) != (ssize_t) slot_bytes ||
+        pwrite(fd, &trailer, sizeof(trailer), offset + seed_bytes + slot_bytes) !=
+            (ssize_t) sizeof(trailer))
+    {
+        printf("ERROR: Could not write symbol index\n");
+        exit(1);
+    }
+}
+
+void write_module(int i)
+{
+    if (!hdrs[i].code_size)
+        return;
+
+    // each thread reuses one buffer big enough for the largest module
+    if (!scratch)
+        scratch = (word_t*) arena_alloc(&arena, sizeof(word_t) * max_code_size);
+    word_t* code = scratch;
+
+    size_t bytes = sizeof(word_t) * hdrs[i].code_size;
+    int in = open(paths[i], O_RDONLY);
+    if (in < 0 || pread(in, code, bytes, code_offsets[i]) != (ssize_t) bytes)
+    {
+        printf("ERROR: Could not read in code\n");
         exit(1);
     }
+    close(in);
 
-    fclose(file);
-    free(header);
+    apply_fixups(code, i);
+    if (pwrite(out_fd, code, bytes, out_code_offset + sizeof(word_t) * bases[i]) != (ssize_t) bytes)
+    {
+        printf("ERROR: Could not write code\n");
+        exit(1);
+    }
 }
 
 /*
@@ -353,17 +877,360 @@ int get_args(int op)
     return res; 
 }
 
-void clean_up(int num_files)
+// symbols of one module taking part in member selection
+typedef struct {
+    Header hdr;
+    Sym* syms;      // insymbols, then outsymbols
+} SelModule;
+
+// read the symbols of the module at offset in fd
+static void read_sel_module(SelModule* mod, int fd, long offset, const char* path)
+{
+    arx_read(fd, &mod->hdr, sizeof(Header), offset, path);
+    int count = mod->hdr.insym_size / 5 + mod->hdr.outsym_size / 5;
+    mod->syms = (Sym*) arena_alloc(&arena, sizeof(Sym) * count);
+    arx_read(fd, mod->syms, sizeof(Sym) * count, offset + sizeof(Header), path);
+}
+
+int select_members(int num_files, char** args)
+{
+    int num_objects = 0;
+    int num_archives = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        if (is_archive(args[i]))
+            num_archives++;
+        else
+            num_objects++;
+    }
+
+    // every module that could be linked, objects first, in the order they
+    // join the link; members are appended as they are pulled
+    int max_modules = num_objects;
+    int max_in = 0;
+    Archive* archives = (Archive*) arena_alloc(&arena, sizeof(Archive) * num_archives);
+    for (int i = 0, a = 0; i < num_files; i++)
+    {
+        if (!is_archive(args[i]))
+            continue;
+        Archive* ar = &archives[a++];
+        load_archive(ar, args[i], &arena);
+        max_modules += ar->hdr.num_members;
+        for (uint32_t m = 0; m < ar->hdr.num_members; m++)
+            max_in += ar->members[m].hdr.insym_size / 5;
+    }
+    SelModule* mods = (SelModule*) arena_alloc(&arena, sizeof(SelModule) * max_modules);
+    int* mod_archive = (int*) arena_alloc(&arena, sizeof(int) * max_modules);
+    uint32_t* mod_member = (uint32_t*) arena_alloc(&arena, sizeof(uint32_t) * max_modules);
+
+    int num_mods = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        if (is_archive(args[i]))
+            continue;
+        int fd = open(args[i], O_RDONLY);
+        if (fd < 0)
+        {
+            printf("ERROR: Can't open file %s\n", args[i]);
+            exit(1);
+        }
+        read_sel_module(&mods[num_mods], fd, 0, args[i]);
+        close(fd);
+        max_in += mods[num_mods].hdr.insym_size / 5;
+        mod_archive[num_mods++] = -1;
+    }
+
+    SymTable defined;
+    symtab_init(&defined, max_in, &arena);
+    for (int i = 0; i < num_mods; i++)
+    {
+        for (int j = 0; j < mods[i].hdr.insym_size / 5; j++)
+            symtab_insert(&defined, &mods[i].syms[j], i);
+    }
+
+    // modules are visited in the order they joined, so each outsymbol is
+    // looked at once; a name still undefined comes from the first archive
+    // that defines it
+    for (int i = 0; i < num_mods; i++)
+    {
+        Sym* outs = &mods[i].syms[mods[i].hdr.insym_size / 5];
+        for (int k = 0; k < mods[i].hdr.outsym_size / 5; k++)
+        {
+            if (symtab_find(&defined, outs[k].sym_name))
+                continue;
+
+            for (int a = 0; a < num_archives; a++)
+            {
+                Archive* ar = &archives[a];
+                ArxSym key;
+                memcpy(key.sym_name, outs[k].sym_name, 16);
+                ArxSym* found = (ArxSym*) bsearch(&key, ar->syms, ar->hdr.num_syms, sizeof(ArxSym),
+                    arx_sym_cmp);
+                if (!found || found->member >= ar->hdr.num_members)
+                    continue;
+
+                uint32_t m = found->member;
+                if (!ar->pulled[m])
+                {
+                    ar->pulled[m] = 1;
+                    SelModule* mod = &mods[num_mods];
+                    read_sel_module(mod, ar->fd, ar->members[m].offset, ar->path);
+                    for (int j = 0; j < mod->hdr.insym_size / 5; j++)
+                        symtab_insert(&defined, &mod->syms[j], num_mods);
+                    mod_archive[num_mods] = a;
+                    mod_member[num_mods++] = m;
+                }
+                break;
+            }
+        }
+    }
+
+    alloc_inputs(num_mods);
+    for (int i = 0, o = 0; i < num_mods; i++)
+    {
+        if (mod_archive[i] < 0)
+        {
+            while (is_archive(args[o]))
+                o++;
+            paths[i] = args[o++];
+            file_offsets[i] = 0;
+        }
+        else
+        {
+            Archive* ar = &archives[mod_archive[i]];
+            paths[i] = ar->path;
+            file_offsets[i] = ar->members[mod_member[i]].offset;
+        }
+    }
+
+    for (int a = 0; a < num_archives; a++)
+        close_archive(&archives[a]);
+    return num_mods;
+}
+
+FileStamp stamp_of(struct stat* st)
+{
+    FileStamp stamp;
+    memset(&stamp, 0, sizeof(stamp));
+    stamp.size = st->st_size;
+    stamp.mtime_sec = st->st_mtim.tv_sec;
+    stamp.mtime_nsec = st->st_mtim.tv_nsec;
+    stamp.ino = st->st_ino;
+    return stamp;
+}
+
+void save_state(char* state_name, char* out_name, int num_files)
+{
+    struct stat st;
+    if (stat(out_name, &st) != 0)
+        return;
+
+    FILE* file = fopen(state_name, "w");
+    if (!file)
+    {
+        printf("ERROR: Could not make output file %s\n", state_name);
+        exit(1);
+    }
+
+    StateHeader head;
+    memset(&head, 0, sizeof(head));
+    head.magic = LINK_STATE_MAGIC;
+    head.num_files = num_files;
+    head.tot_in = tot_in;
+    head.tot_out = tot_out;
+    head.exe_size = st.st_size;
+
+    int ok = fwrite(&head, sizeof(head), 1, file) == 1;
+    for (int i = 0; i < num_files && ok; i++)
+    {
+        StateFile rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.hdr = hdrs[i];
+        rec.stamp = stamps[i];
+        rec.num_fixups = num_fixups[i];
+        rec.path_len = strlen(paths[i]);
+        ok = fwrite(&rec, sizeof(rec), 1, file) == 1 &&
+            fwrite(paths[i], 1, rec.path_len, file) == rec.path_len;
+    }
+
+    // insymbols go back to module addresses, as an input would give them
+    for (int i = 0; i < num_files && ok; i++)
+    {
+        for (int j = 0; j < hdrs[i].insym_size / 5 && ok; j++)
+        {
+            Sym sym = insyms[i][j];
+            sym.addr -= bases[i];
+            ok = fwrite(&sym, sizeof(Sym), 1, file) == 1;
+        }
+    }
+    for (int i = 0; i < num_files && ok; i++)
+    {
+        ok = fwrite(outsyms[i], sizeof(Sym), hdrs[i].outsym_size / 5, file) == hdrs[i].outsym_size / 5 &&
+            fwrite(fixups[i], sizeof(Fixup), num_fixups[i], file) == num_fixups[i];
+    }
+
+    if (!ok)
+    {
+        printf("ERROR: Could not write %s\n", state_name);
+        exit(1);
+    }
+    fclose(file);
+}
+
+// Load the state of the last link into the link arrays, as if every input
+// had been read again. Returns 0 when there is no usable state.
+static int load_state(char* state_name, char* out_name, int num_files)
 {
+    FILE* file = fopen(state_name, "r");
+    if (!file)
+        return 0;
+
+    StateHeader head;
+    struct stat st;
+    if (fread(&head, sizeof(head), 1, file) != 1 || head.magic != LINK_STATE_MAGIC ||
+        head.num_files != num_files || stat(out_name, &st) != 0 || st.st_size != head.exe_size)
+    {
+        fclose(file);
+        return 0;
+    }
+
+    // the records come first so the arena can be sized from their headers;
+    // a state that turns out unusable gives back what was allocated for it
+    size_t mark = atomic_load(&arena.used);
+    StateFile* recs = (StateFile*) arena_alloc(&arena, sizeof(StateFile) * num_files);
+    int ok = 1;
+    for (int i = 0; i < num_files && ok; i++)
+    {
+        char path[PATH_MAX];
+        ok = fread(&recs[i], sizeof(StateFile), 1, file) == 1 && recs[i].path_len < PATH_MAX &&
+            fread(path, 1, recs[i].path_len, file) == recs[i].path_len;
+        // the same inputs in the same order, or the layout is different
+        ok = ok && strlen(paths[i]) == recs[i].path_len &&
+            memcmp(path, paths[i], recs[i].path_len) == 0;
+    }
+    if (!ok)
+    {
+        arena_rewind(&arena, mark);
+        fclose(file);
+        return 0;
+    }
+
+    hdrs = (Header*) arena_alloc(&arena, sizeof(Header) * num_files);
     for (int i = 0; i < num_files; i++)
+        hdrs[i] = recs[i].hdr;
+    alloc_link(num_files, sizeof(Fixup) * head.tot_out);
+
+    Fixup* all_old = (Fixup*) arena_alloc(&arena, sizeof(Fixup) * head.tot_out);
+    int out_at = 0;
+    for (int i = 0; i < num_files; i++)
+    {
+        stamps[i] = recs[i].stamp;
+        old_num_fixups[i] = recs[i].num_fixups;
+        old_fixups[i] = &all_old[out_at];
+        out_at += hdrs[i].outsym_size / 5;
+    }
+
+    ok = head.tot_in == tot_in && head.tot_out == tot_out &&
+        fread(exe_insyms, sizeof(Sym), tot_in, file) == tot_in;
+    for (int i = 0; i < num_files && ok; i++)
+    {
+        ok = old_num_fixups[i] <= hdrs[i].outsym_size / 5 &&
+            fread(outsyms[i], sizeof(Sym), hdrs[i].outsym_size / 5, file) == hdrs[i].outsym_size / 5 &&
+            fread(old_fixups[i], sizeof(Fixup), old_num_fixups[i], file) == old_num_fixups[i];
+    }
+    fclose(file);
+    if (!ok)
+        arena_rewind(&arena, mark);
+    return ok;
+}
+
+void check_input(int i)
+{
+    struct stat st;
+    if (stat(paths[i], &st) != 0)
+    {
+        printf("ERROR: Can't open file %s\n", paths[i]);
+        exit(1);
+    }
+
+    FileStamp stamp = stamp_of(&st);
+    if (memcmp(&stamp, &stamps[i], sizeof(stamp)) == 0)
+        return;
+
+    changed[i] = 1;
+    FILE* file = fopen(paths[i], "r");
+    if (!file)
     {
-        free(insyms[i]);
-        free(outsyms[i]);
-        free(codes[i]);
+        printf("ERROR: Can't open file %s\n", paths[i]);
+        exit(1);
     }
+    Header hdr = read_header(file);
+    fclose(file);
+
+    // only a module that keeps its sizes can be patched in place
+    if (memcmp(&hdr, &hdrs[i], sizeof(hdr)) != 0)
+        atomic_store(&relayout, 1);
+    else
+        read_input(i);
+}
+
+void patch_module(int i)
+{
+    if (!changed[i] && num_fixups[i] == old_num_fixups[i] &&
+            memcmp(fixups[i], old_fixups[i], sizeof(Fixup) * num_fixups[i]) == 0)
+        return;
 
-    free(insyms);
-    free(outsyms);
-    free(hdrs);
-    free(codes);
+    if (changed[i])
+    {
+        size_t bytes = sizeof(Sym) * (hdrs[i].insym_size / 5);
+        if (pwrite(out_fd, insyms[i], bytes, sizeof(Header) + sizeof(Sym) * insym_starts[i]) !=
+                (ssize_t) bytes)
+        {
+            printf("ERROR: Could not write insymbols\n");
+            exit(1);
+        }
+    }
+    write_module(i);
+}
+
+int relink(char* state_name, char* out_name, int num_files)
+{
+    // the full link that follows a failed relink keeps the inputs
+    size_t mark = atomic_load(&arena.used);
+    if (!load_state(state_name, out_name, num_files))
+        return 0;
+
+    parallel_for(num_files, check_input);
+    if (atomic_load(&relayout))
+    {
+        arena_rewind(&arena, mark);
+        return 0;
+    }
+
+    int any = 0;
+    for (int i = 0; i < num_files; i++)
+        any |= changed[i];
+    if (!any)
+        return 1;
+
+    // resolving again is all in memory; only modules whose code or fixups
+    // differ from the last link are read and written
+    resolve_link(num_files);
+    out_fd = open(out_name, O_RDWR);
+    if (out_fd < 0)
+    {
+        printf("ERROR: Could not make output file %s\n", out_name);
+        exit(1);
+    }
+    out_code_offset = sizeof(Header) + sizeof(Sym) * tot_in;
+    parallel_for(num_files, patch_module);
+    close(out_fd);
+
+    save_state(state_name, out_name, num_files);
+    return 1;
+}
+
+void clean_up()
+{
+    arena_free(&arena);
 }
@@ -3,10 +3,30 @@
 #include <stdint.h> 
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 // how large a word is (occupies the same amount of space) 
 #define word_t uint32_t
 
+// fewest threads used to read, resolve and write modules
+#define LINK_MIN_THREADS 8
+
+// alignment of every arena allocation
+#define ARENA_ALIGN 16
+
+// address space an arena reserves; only what is used gets committed
+#define ARENA_RESERVE ((size_t) 1 << 36)
+
+// one reservation carved up by a bump pointer; threads may allocate
+// concurrently, and allocations never move
+typedef struct {
+    char* base;
+    atomic_size_t size;     // bytes committed so far
+    atomic_size_t used;
+} Arena;
+
 typedef struct {
     word_t insym_size;
     word_t outsym_size;
@@ -18,6 +38,150 @@ typedef struct {
     word_t addr;
 } Sym;
 
+// a resolved outsymbol reference: the global index of the word to patch
+// and the global address of the insymbol it refers to
+typedef struct {
+    word_t index;
+    word_t target;
+} Fixup;
+
+// one insymbol definition in the symbol index; sym is claimed atomically
+// so modules can be indexed in parallel
+typedef struct {
+    Sym* _Atomic sym;
+    int file;
+} SymEntry;
+
+// identity of an input file when it was linked, to spot changed inputs
+typedef struct {
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ino;
+} FileStamp;
+
+// Version 2 executables stay readable as version 1: unnamed insymbols pad
+// the symbol table so the code starts on a page boundary, and the symbol
+// index and metadata follow the code, found through the ExeTrailer that
+// ends the file.
+#define EXE_PAGE 4096
+
+// "XEX2", first word of the ExeTrailer
+#define EXE2_MAGIC 0x32584558
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_syms;      // insymbols before the padding
+    uint32_t entry;         // address the processors start at
+    uint32_t memory_words;  // smallest address space the program runs in
+    uint32_t stack_words;   // stack each processor needs, 0 if not given
+    uint32_t index_offset;  // file offset of the symbol index
+    uint32_t index_buckets; // the index holds a seed per bucket, then
+    uint32_t index_slots;   // a symbol number (or -1) per slot, a power of two
+    uint32_t reserved;
+} ExeTrailer;
+
+// "LNKS", first word of the state file written by -i links
+#define LINK_STATE_MAGIC 0x534b4e4c
+
+// State file layout: StateHeader, then per input a StateFile and its path,
+// then every module's insymbols (module addresses), then per module its
+// outsymbols and fixups.
+typedef struct {
+    uint32_t magic;
+    uint32_t num_files;
+    uint32_t tot_in;
+    uint32_t tot_out;
+    int64_t exe_size;       // size of the output the state describes
+} StateHeader;
+
+typedef struct {
+    Header hdr;
+    FileStamp stamp;
+    int32_t num_fixups;
+    uint32_t path_len;
+} StateFile;
+
+// "ARX2", first word of an archive of object files
+#define ARX_MAGIC 0x32585241
+
+// Archive layout: ArxHeader, an ArxMember per object file, the index of
+// every insymbol the members define as ArxSyms sorted by name, then the
+// object files themselves, whole.
+typedef struct {
+    uint32_t magic;
+    uint32_t num_members;
+    uint32_t num_syms;
+} ArxHeader;
+
+typedef struct {
+    char name[16];      // file name of the object, for listings
+    Header hdr;
+    uint32_t offset;    // where the object file starts in the archive
+    uint32_t size;
+} ArxMember;
+
+typedef struct {
+    char sym_name[16];
+    uint32_t member;
+} ArxSym;
+
+// an archive input of a link: its member table, its symbol index and which
+// members the link pulls in
+typedef struct {
+    char* path;
+    int fd;
+    ArxHeader hdr;
+    ArxMember* members;
+    ArxSym* syms;
+    char* pulled;
+} Archive;
+
+// open addressing hash table of every insymbol, keyed on sym_name
+typedef struct {
+    SymEntry* entries;
+    int cap;
+} SymTable;
+
+// start count worker threads for parallel_for, kept for the whole link
+void start_workers(int count);
+
+// stop and join the threads of start_workers
+void stop_workers();
+
+// run fn(0) ... fn(count - 1) on the calling thread and the workers
+void parallel_for(int count, void (*fn)(int));
+
+// whether path names an archive rather than an object file
+int is_archive(const char* path);
+
+// order ArxSyms by name
+int arx_sym_cmp(const void* a, const void* b);
+
+// calloc that exits when memory runs out
+void* arx_alloc(size_t bytes);
+
+// read bytes at offset of an open file, exiting if they aren't all there
+void arx_read(int fd, void* buf, size_t bytes, long offset, const char* path);
+
+// read the member table and symbol index of an archive input into arena
+void load_archive(Archive* ar, char* path, Arena* arena);
+
+// close an archive loaded by load_archive; its tables go with the arena
+void close_archive(Archive* ar);
+
+// Replace the archives among the inputs by the members that define an
+// outsymbol no linked module defines, repeating until no more are needed.
+// Fills paths and file_offsets and returns the number of modules.
+int select_members(int num_files, char** args);
+
+// read the header of input i
+void read_input_header(int i);
+
+// read the symbols of input i into its slices of the symbol arrays
+void read_input(int i);
+
 // Read the header data into a structure
 Header read_header(FILE *file);
 
@@ -27,26 +191,102 @@ void read_syms(Sym* syms, int num_syms, FILE* file);
 // Read the code section into an array of 8 bit (one byte) integers
 void read_code(word_t* code, int code_size, FILE* file);
 
-// Ensure the mainx20 function is present in a given file
-bool check_mainx20(Sym* syms, Header hdr);
+// fill in the global base address of each module
+void compute_bases(int num_files);
+
+// allocate paths and file_offsets for num_files modules
+void alloc_inputs(int num_files);
+
+// size the arena from the headers and lay out the per-link arrays in it,
+// with extra bytes to spare
+void alloc_link(int num_files, size_t extra);
+
+// place the modules, index and check the insymbols and resolve every
+// outsymbol; exits on link errors
+void resolve_link(int num_files);
 
-// Put code section of each file into one array
-word_t* get_code();
+// Keep only the modules reachable from the entry module and mainx20's
+// through resolved outsymbols, then place and resolve the link again.
+void drop_dead_modules(int num_files);
 
 // get a number related to number of args with addrs
 int get_args(int op);
 
-// resolve the outsymbols
-int res_syms(word_t* code, Sym* exe_insyms, int num_files, int tot_in);
+// resolve the outsymbols of module i into its fixups
+void res_syms(int i);
+
+// patch the code of one module with its fixups
+void apply_fixups(word_t* code, int file);
+
+// bytes of the symbol index for num_syms insymbols
+size_t symtab_bytes(int num_syms);
+
+// size the symbol index for num_syms insymbols, in arena
+void symtab_init(SymTable* table, int num_syms, Arena* arena);
+
+// add a definition, returning the earlier one if the name is already defined
+SymEntry* symtab_insert(SymTable* table, Sym* sym, int file);
 
-// get all of the insymbols into a 1D array
-Sym get_exe_insym(char* insym_name, Sym* exe_insyms, int tot_in);
+// look up the definition of a name, NULL if it is not defined
+SymEntry* symtab_find(SymTable* table, const char* name);
 
-// add the global address of each insymbol definition
-void adjust_insym_addr(int num_files, Sym* exe_insyms);
+// copy module i's insymbols into exe_insyms at their global addresses
+void adjust_insym_addr(int i);
+
+// add module i's insymbols to the symbol index, noting any duplicate
+void index_insyms(int i);
+
+// the duplicate insymbol to report, found in file order
+Sym* first_dup(int tot_in);
 
 // create the output .exe file
-void create_file(char* file_name, word_t* code, Sym* insyms, int tot_in, int num_files);
+void create_file(char* file_name, Sym* insyms, int tot_in, int num_files);
+
+// hash of a symbol name for the v2 symbol index
+uint32_t exe_hash(const char* name, uint32_t seed);
+
+// Build the perfect hash index of a v2 executable's insymbols into
+// trailer, seeds and slots: a name's bucket gives the seed that hashes it
+// to its own slot.
+void build_index(Sym* syms, int num_syms, ExeTrailer* trailer, uint32_t** seeds, int32_t** slots);
+
+// append the symbol index and trailer of a v2 executable after its code
+void write_trailer(int fd, long offset, Sym* syms, int num_syms, word_t code_size);
+
+// patch module i's code and write it to its place in the output
+void write_module(int i);
+
+// reserve an arena, committing its first size bytes
+void arena_init(Arena* arena, size_t size);
+
+// commit the arena's first size bytes, so the allocations that fill them
+// don't have to
+void arena_reserve(Arena* arena, size_t size);
+
+// take zeroed bytes from arena, exiting when it is used up
+void* arena_alloc(Arena* arena, size_t bytes);
+
+// give back everything allocated since used was mark, zeroing it again
+void arena_rewind(Arena* arena, size_t mark);
+
+// unmap the arena and everything allocated from it
+void arena_free(Arena* arena);
+
+// identity of a file from its stat
+FileStamp stamp_of(struct stat* st);
+
+// write what a later -i link needs to patch the output in place
+void save_state(char* state_name, char* out_name, int num_files);
+
+// note whether input i changed since the last link and read it again if so
+void check_input(int i);
+
+// rewrite module i in the output if it or its fixups changed
+void patch_module(int i);
+
+// bring the output up to date from the state of the last link; returns 0
+// when a full link is needed instead
+int relink(char* state_name, char* out_name, int num_files);
 
-// free memory 
+// free everything the link allocated
 void clean_up();